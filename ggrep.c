@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // memmem() on glibc
 #include <sys/types.h>  // Good practice for POSIX data types (like size_t, etc.)
 #include <stddef.h>     // Provides NULL
 #include <stdlib.h>     // Standard library functions (often includes NULL)
@@ -7,16 +8,73 @@
 #include <stdbool.h>
 #include <glob.h>
 #include <ctype.h>
-#include <stdarg.h>
+#include <errno.h>
 #include <unistd.h>
 #include <regex.h>
 #include <getopt.h>  // POSIX getopt
+#include <sys/stat.h>   // fstat() to see what stdout and the input files are
+#include <dirent.h>     // --index walks directory trees
+#include <poll.h>       // wait for input with a timeout, so pending output can be flushed
+#include <time.h>       // clock_gettime() for the output flush deadline
+#include <stdint.h>     // SIZE_MAX: no -l limit
+#include <limits.h>     // INT_MAX
+#include <fcntl.h>      // splice(), posix_fadvise()
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <sys/mman.h>   // mmap() and madvise(): the input ring, huge pages; mincore() for --hot-first
+#include <sys/wait.h>   // waitpid(): index shards are built and searched by processes of their own
+#include "ggrep_binary.h"  // --format=binary record layout
+#if defined(__SSE2__)
+#include <emmintrin.h>  // SSE2 intrinsics for byte scanning
+#include <tmmintrin.h>  // SSSE3 byte shuffles for decoding index posting lists (checked for at run time)
+#elif defined(__aarch64__)
+#include <arm_neon.h>   // NEON intrinsics for byte scanning
+#endif
 
-#define MAX_LINE_LEN 8192	// longest line we'll try to display or search
 #define UNUSED(x) (void)(x)	// tell compiler when we intentionally don't use a variable
 #define TAB_WIDTH 4
 #define GGREP_VERSION "2.6.3"
 
+// ------------------ Memory budget ----------
+// Every buffer that can be big (input, output, -b context, long lines, the -E DFA) is
+// charged here. With --max-memory the buffers that can grow check mem_fits first and make
+// do without the memory if it doesn't: -b lines stop being pinned and are read from the file
+// again, long lines are searched in pieces, and the DFA cache is kept smaller. Input that
+// can't be read again (a pipe) can't always make do: a long line that has to be printed, or
+// -b lines that were let go, are counted in lost and ggrep exits non-zero, and a line that
+// can't be searched in pieces is an error rather than a reason to go over the limit
+// --stats also reports how many allocations were made and how much of the input was copied
+// (or read again) after it was read. Neither should grow with the number of lines: the
+// search works on views into the reader's buffer, so both stay flat for ordinary input.
+// These only see our own helpers; "make test-alloc" checks the same from outside, counting
+// libc's allocations (regcomp, regexec) and every memcpy as well
+typedef struct {
+    size_t limit;	// --max-memory (0: no limit)
+    size_t used;
+    size_t peak;
+    unsigned long allocs;		// allocations made (the x*alloc, big_* and ring helpers)
+    unsigned long long input;	// bytes read from the input
+    unsigned long long copied;	// input bytes moved or read again after they were first read
+    unsigned long lost;		// lines that should have been output but couldn't be within the limit
+} MemBudget;
+
+MemBudget mem;
+
+// could n more bytes be charged without going over --max-memory?
+bool mem_fits(size_t n) {
+    return mem.limit == 0 || (mem.used <= mem.limit && n <= mem.limit - mem.used);
+}
+
+void mem_charge(size_t n) {
+    mem.used += n;
+    if (mem.used > mem.peak) mem.peak = mem.used;
+}
+
+void mem_release(size_t n) {
+    mem.used -= n;
+}
+
 // ------------------Memory safe allocation helpers ----------
 void *xmalloc(size_t size) {
     void *ptr = malloc(size);
@@ -24,6 +82,7 @@ void *xmalloc(size_t size) {
         fprintf(stderr, "Fatal: Out of memory (malloc %zu bytes).\n", size);
         exit(EXIT_FAILURE);
     }
+    mem.allocs++;
     return ptr;
 }
 
@@ -33,9 +92,101 @@ void *xcalloc(size_t count, size_t size) {
         fprintf(stderr, "Fatal: Out of memory (calloc %zu count %zu bytes).\n", count, size);
         exit(EXIT_FAILURE);
     }
+    mem.allocs++;
     return ptr;
 }
 
+void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p == NULL && size > 0) {
+        fprintf(stderr, "Fatal: Out of memory (realloc %zu bytes).\n", size);
+        exit(EXIT_FAILURE);
+    }
+    mem.allocs++;
+    return p;
+}
+
+// ------------------ Huge page allocation helpers ----------
+// The big long-lived buffers (input, output, the -E DFA) can be backed by 2 MB pages, so
+// scanning them takes one TLB entry per 2 MB instead of one per 4 KB (--huge-pages).
+// HUGE_THP asks for transparent huge pages with madvise(); HUGE_TLB maps them from the
+// hugetlbfs pool the admin has set aside, and falls back to HUGE_THP if there are none
+typedef enum {
+    HUGE_OFF,
+    HUGE_THP,
+    HUGE_TLB
+} HugePages;
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HUGE_MAPS_MAX 8
+
+HugePages huge_pages = HUGE_OFF;	// set once, from --huge-pages, before anything is allocated
+
+// blocks that came from mmap(MAP_HUGETLB), so big_free knows to munmap() them
+struct {
+    void *p;
+    size_t size;
+} huge_maps[HUGE_MAPS_MAX];
+
+// size bytes for a big buffer, charged to the memory budget. With --huge-pages *size is
+// rounded up to whole huge pages (the caller may use them all). Free it with big_free
+void *big_alloc(size_t *size) {
+    if (huge_pages != HUGE_OFF) *size = (*size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    mem_charge(*size);
+    if (huge_pages == HUGE_OFF) return xmalloc(*size);
+
+#if defined(__linux__) && defined(MAP_HUGETLB)
+    if (huge_pages == HUGE_TLB) {
+        for (int i = 0; i < HUGE_MAPS_MAX; i++) {
+            if (huge_maps[i].p) continue;
+            void *p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p == MAP_FAILED) break;
+            huge_maps[i].p = p;
+            huge_maps[i].size = *size;
+            mem.allocs++;
+            return p;
+        }
+    }
+#endif
+    void *p = NULL;
+    if (posix_memalign(&p, HUGE_PAGE_SIZE, *size) != 0) {
+        fprintf(stderr, "Fatal: Out of memory (aligned alloc %zu bytes).\n", *size);
+        exit(EXIT_FAILURE);
+    }
+    mem.allocs++;
+#ifdef MADV_HUGEPAGE
+    madvise(p, *size, MADV_HUGEPAGE);	// only a hint: no matter if the kernel says no
+#endif
+    return p;
+}
+
+void big_free(void *p, size_t size) {
+    if (p) mem_release(size);
+    for (int i = 0; i < HUGE_MAPS_MAX; i++) {
+        if (p && huge_maps[i].p == p) {
+            munmap(p, huge_maps[i].size);
+            huge_maps[i].p = NULL;
+            return;
+        }
+    }
+    free(p);
+}
+
+// grow p from old_size to *size bytes (rounded up as big_alloc does), keeping its first keep bytes
+void *big_realloc(void *p, size_t keep, size_t old_size, size_t *size) {
+    if (huge_pages == HUGE_OFF) {
+        mem_release(old_size);
+        mem_charge(*size);
+        mem.copied += keep;		// realloc() may have to move it
+        return xrealloc(p, *size);
+    }
+    void *q = big_alloc(size);
+    memcpy(q, p, keep);
+    mem.copied += keep;
+    big_free(p, old_size);
+    return q;
+}
+
 // -----------------------------------------------------
 // ------------------ Options Parsing ------------------
 // -----------------------------------------------------
@@ -52,6 +203,7 @@ HelpDef help_table[] = {
 	{"-i",   "Ignore case when searching (default is case sensitive)"},
     {"-r",   "Show lines that do NOT match search pattern"},
     {"-E",   "Treat the pattern as a POSIX regex"},
+    {"-x",   "The pattern is given in hex (e.g. -x 00ff41), so it can hold any bytes"},
     {"-n",   "Show line numbers"},
     {"-f",   "Show file basename on each line"},
     {"-F",   "Show file name as section title"},
@@ -59,20 +211,84 @@ HelpDef help_table[] = {
     {"-c",   "Show only a count of matching lines"},
     {"-v",   "Display ggrep version information"},
     {"-h",   "Display this help message"},
-    {"-b N", "Print N lines before a match (e.g. -b2) maximum 50 lines"},
+    {"-b N", "Print N lines before a match (e.g. -b2) no maximum"},
     {"-a N", "Print N lines after a match (e.g. -a3) no maximum"},
     {"-l N", "Print only the first n chars of each line (e.g. -l20)"},
     {"-L N", "Crop the first n chars of each line (e.g. -L5)"},
+    {"--color[=WHEN]", "Highlight matches: auto (if output is a terminal), always or never"},
+    {"--format=FMT", "Output format: text (default), json (one JSON object per line) or binary"},
+    {"--json", "Same as --format=json"},
+    {"--with-lines", "Include the line text in --format=binary records"},
+    {"--raw", "Print lines exactly as they are (no tab expansion); large blocks are copied by the kernel"},
+    {"--line-buffered", "Write out every line as soon as it is found"},
+    {"--flush-ms=N", "Write out found lines within N ms (default 50 for pipes; terminals get every line)"},
+    {"--huge-pages[=HOW]", "Put the big buffers in 2 MB pages: thp (default, transparent) or hugetlb (reserved pool)"},
+    {"--max-memory=SIZE", "Use at most about SIZE bytes for buffers (K, M or G suffix); long lines are searched in pieces. A long line from a pipe that is printed still has to fit whole: one that doesn't is left out and ggrep exits non-zero"},
+    {"--stats", "Print the peak memory used, allocations made and input bytes copied to stderr at the end"},
+    {"--hot-first", "Search files already in the page cache first, then the ones that need disk reads"},
+    {"--index build DIR", "Make (or remake) a trigram index of the files under DIR, in DIR/.ggrep_index"},
+    {"--index update DIR", "Index just the files under DIR that are new or changed since the index was made"},
+    {"--index merge DIR", "Merge the updates into the index of DIR"},
+    {"--index bench DIR", "Time decoding the posting lists of the index of DIR, against reading them as plain uint32 arrays"},
+    {"--index DIR", "Search the files under DIR, reading only those its index says could match (a DIR named build, update or merge has to be given as ./build and so on)"},
+    {"--explain", "With --index DIR: print the trigram query the pattern needs and how many files it leaves"},
+    {"--shards=N", "With --index build: split the index into N shards, built and searched in parallel (default 1)"},
     {NULL, NULL} // sentinel
 };
 
-const char option_list[] = "irEnfFmcvhb:a:l:L:";
+const char option_list[] = "irExnfFmcvhb:a:l:L:";
+
+// long options have no single letter equivalent, so use values outside the char range
+enum { OPT_COLOR = 256, OPT_FORMAT, OPT_JSON, OPT_WITH_LINES, OPT_RAW, OPT_LINE_BUFFERED, OPT_FLUSH_MS,
+       OPT_HUGE_PAGES, OPT_MAX_MEMORY, OPT_STATS,
+       OPT_HOT_FIRST, OPT_INDEX, OPT_EXPLAIN, OPT_SHARDS };
+const struct option long_options[] = {
+    {"color",  optional_argument, NULL, OPT_COLOR},
+    {"colour", optional_argument, NULL, OPT_COLOR},
+    {"format", required_argument, NULL, OPT_FORMAT},
+    {"json",   no_argument,       NULL, OPT_JSON},
+    {"with-lines", no_argument,   NULL, OPT_WITH_LINES},
+    {"raw",    no_argument,       NULL, OPT_RAW},
+    {"line-buffered", no_argument, NULL, OPT_LINE_BUFFERED},
+    {"flush-ms", required_argument, NULL, OPT_FLUSH_MS},
+    {"huge-pages", optional_argument, NULL, OPT_HUGE_PAGES},
+    {"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+    {"stats",  no_argument,       NULL, OPT_STATS},
+    {"hot-first", no_argument,    NULL, OPT_HOT_FIRST},
+    {"index",  required_argument, NULL, OPT_INDEX},
+    {"explain", no_argument,      NULL, OPT_EXPLAIN},
+    {"shards", required_argument, NULL, OPT_SHARDS},
+    {NULL, 0, NULL, 0} // sentinel
+};
+
+// --format
+typedef enum {
+    FORMAT_TEXT,	// human readable (the default)
+    FORMAT_JSON,	// JSON Lines: one object per output line
+    FORMAT_BINARY	// length-prefixed records, see ggrep_binary.h
+} OutputFormat;
+
+// --index
+typedef enum {
+    INDEX_NONE,		// search the files named (or stdin)
+    INDEX_SEARCH,	// --index DIR: search the tree at DIR with its index
+    INDEX_BUILD,	// --index build DIR
+    INDEX_UPDATE,	// --index update DIR
+    INDEX_MERGE,	// --index merge DIR
+    INDEX_BENCH		// --index bench DIR
+} IndexMode;
+
+#define INDEX_MAX_SHARDS 64	// --shards
 
 // ------------------ Options structure ------------------
+typedef struct StreamRegex StreamRegex;	// -E as a DFA, see Streaming Regex
+typedef struct Pattern Pattern;			// the pattern and its search tables, see Pattern
+
 typedef struct {
     bool ignore_case;		// -i
     bool reverse_find;		// -r
     bool use_regex;			// -E
+    bool hex_pattern;		// -x
     bool show_line_numbers;	// -n
     bool show_filename;		// -f
     bool filename_title;	// -F
@@ -82,22 +298,40 @@ typedef struct {
     bool show_help;			// -h
     int before;   			// -bN
     int after;   			// -aN
-    int line_limit; 		// -lN
+    int line_limit; 		// -lN (-1: whole line)
     int line_crop; 			// -LN
-    char *pattern;			// will come from argv[]
+    bool color;				// --color (already resolved against isatty for "auto")
+    OutputFormat format;	// --format / --json
+    bool with_lines;		// --with-lines: binary records carry the line text
+    bool raw;				// --raw: no tab expansion, output may bypass the buffer
+    bool line_buffered;		// --line-buffered
+    int flush_ms;			// --flush-ms=N (-1 if not given)
+    HugePages huge_pages;	// --huge-pages
+    size_t max_memory;		// --max-memory=SIZE (0: no limit)
+    bool stats;				// --stats
+    bool hot_first;			// --hot-first
+    IndexMode index_mode;	// --index
+    const char *index_dir;	// the tree --index searches or builds the index of
+    bool explain;			// --explain
+    int shards;				// --shards=N: for --index build (0 if not given)
+    const char *pattern_arg;	// the pattern as it is on the command line
+    Pattern *pattern;		// built from pattern_arg in main, then only read
+    StreamRegex *stream;	// -E: the pattern as a DFA (NULL if only regexec() can do it)
 } Options;
 
 // ----------------------- parsing function ---------------
 void parse_options(int argc, char *argv[], Options *opts, int *first_file_index) {
     *opts = (Options){0};
-    opts->line_limit = MAX_LINE_LEN - 1;
+    opts->line_limit = -1;
+    opts->flush_ms = -1;
 
     int opt;
-    while ((opt = getopt(argc, argv, option_list)) != -1) {
+    while ((opt = getopt_long(argc, argv, option_list, long_options, NULL)) != -1) {
         switch (opt) {
             case 'i': opts->ignore_case = true; break;
             case 'r': opts->reverse_find = true; break;
             case 'E': opts->use_regex = true; break;
+            case 'x': opts->hex_pattern = true; break;
             case 'n': opts->show_line_numbers = true; break;
             case 'f': opts->show_filename = true; break;
             case 'F': opts->filename_title = true; break;
@@ -111,7 +345,6 @@ void parse_options(int argc, char *argv[], Options *opts, int *first_file_index)
             	if(!opts->filename_only){
 					int n = atoi(optarg);
 					if (n < 0) n = 0;
-					if (n > 50) n = 50;
 					opts->before = n;
 					}
                 break;
@@ -125,18 +358,112 @@ void parse_options(int argc, char *argv[], Options *opts, int *first_file_index)
             case 'l': {
                 int n = atoi(optarg);
                 if (n < 0) n = 0;
-                if (n >= MAX_LINE_LEN) n = MAX_LINE_LEN - 1;
                 opts->line_limit = n;
                 break;
             }
             case 'L': {
                 int n = atoi(optarg);
                 if (n < 0) n = 0;
-                if (n >= MAX_LINE_LEN) n = MAX_LINE_LEN - 1;
                 opts->line_crop = n;
                 break;
             }
 
+// +++++++++++
+// Handle --color: 1of3: work out now whether we highlight; "auto" means only on a terminal
+// +++++++++++
+            case OPT_COLOR: {
+                if (!optarg || strcmp(optarg, "auto") == 0) {
+                    const char *term = getenv("TERM");
+                    opts->color = isatty(STDOUT_FILENO) && !(term && strcmp(term, "dumb") == 0);
+                } else if (strcmp(optarg, "always") == 0) {
+                    opts->color = true;
+                } else if (strcmp(optarg, "never") == 0) {
+                    opts->color = false;
+                } else {
+                    fprintf(stderr, "Invalid --color value: %s (use auto, always or never)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+
+// +++++++++++
+// Handle --format and --json: 1of2: choose the output format
+// +++++++++++
+            case OPT_FORMAT: {
+                if (strcmp(optarg, "text") == 0) opts->format = FORMAT_TEXT;
+                else if (strcmp(optarg, "json") == 0) opts->format = FORMAT_JSON;
+                else if (strcmp(optarg, "binary") == 0) opts->format = FORMAT_BINARY;
+                else {
+                    fprintf(stderr, "Invalid --format value: %s (use text, json or binary)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case OPT_JSON: opts->format = FORMAT_JSON; break;
+            case OPT_WITH_LINES: opts->with_lines = true; break;
+            case OPT_RAW: opts->raw = true; break;
+            case OPT_LINE_BUFFERED: opts->line_buffered = true; break;
+            case OPT_FLUSH_MS: {
+                int n = atoi(optarg);
+                if (n < 0) n = 0;
+                opts->flush_ms = n;
+                break;
+            }
+            case OPT_HUGE_PAGES: {
+                if (!optarg || strcmp(optarg, "thp") == 0) opts->huge_pages = HUGE_THP;
+                else if (strcmp(optarg, "hugetlb") == 0) opts->huge_pages = HUGE_TLB;
+                else {
+                    fprintf(stderr, "Invalid --huge-pages value: %s (use thp or hugetlb)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case OPT_MAX_MEMORY: {
+                char *end;
+                unsigned long long n = strtoull(optarg, &end, 10);
+                int shift = 0;
+                if (*end == 'K' || *end == 'k') shift = 10;
+                else if (*end == 'M' || *end == 'm') shift = 20;
+                else if (*end == 'G' || *end == 'g') shift = 30;
+                if (shift) end++;
+                if (end == optarg || *end != '\0' || n == 0 || n > (SIZE_MAX >> shift)) {
+                    fprintf(stderr, "Invalid --max-memory value: %s (e.g. 64M)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                opts->max_memory = (size_t)n << shift;
+                break;
+            }
+            case OPT_STATS: opts->stats = true; break;
+            case OPT_HOT_FIRST: opts->hot_first = true; break;
+            case OPT_EXPLAIN: opts->explain = true; break;
+            case OPT_SHARDS: {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || n < 1 || n > INDEX_MAX_SHARDS) {
+                    fprintf(stderr, "Invalid --shards value: %s (1 to %d)\n", optarg, INDEX_MAX_SHARDS);
+                    exit(EXIT_FAILURE);
+                }
+                opts->shards = (int)n;
+                break;
+            }
+            case OPT_INDEX: {
+                // "--index build DIR" (and update, merge) take the directory from the next
+                // argument (below)
+                if (strcmp(optarg, "build") == 0) {
+                    opts->index_mode = INDEX_BUILD;
+                } else if (strcmp(optarg, "update") == 0) {
+                    opts->index_mode = INDEX_UPDATE;
+                } else if (strcmp(optarg, "merge") == 0) {
+                    opts->index_mode = INDEX_MERGE;
+                } else if (strcmp(optarg, "bench") == 0) {
+                    opts->index_mode = INDEX_BENCH;
+                } else {
+                    opts->index_mode = INDEX_SEARCH;
+                    opts->index_dir = optarg;
+                }
+                break;
+            }
+
             default:
                 fprintf(stderr, "Unknown option: -%c\n", optopt);
                 exit(EXIT_FAILURE);
@@ -144,16 +471,20 @@ void parse_options(int argc, char *argv[], Options *opts, int *first_file_index)
     }
 
     // After getopt() finishes, optind points to the first non-option argument.
+    if (opts->index_mode != INDEX_NONE && opts->index_mode != INDEX_SEARCH) {
+        // there's no pattern, only the directory
+        if (optind < argc) opts->index_dir = argv[optind++];
+        else opts->show_help = true;
+        *first_file_index = optind;
+        return;
+    }
     if (optind < argc) {
-        char *pattern_copy = xmalloc(MAX_LINE_LEN);
-        strncpy(pattern_copy, argv[optind], MAX_LINE_LEN - 1);
-        pattern_copy[MAX_LINE_LEN - 1] = '\0';
-        opts->pattern = pattern_copy;
+        opts->pattern_arg = argv[optind];
         optind++;
     }
 
     // If no pattern was given, enable help unless -v was specified.
-    if (!opts->pattern && !opts->show_version)
+    if (!opts->pattern_arg && !opts->show_version)
         opts->show_help = true;
 
     *first_file_index = optind;
@@ -173,278 +504,4649 @@ void show_help(void){
 
 
 // -----------------------------------------------------
-// ------------------ Case-insensitive substring search ------------------
+// ------------------ Streaming Regex ------------------
 // -----------------------------------------------------
-bool line_contains(const char *line, const Options *opts, const regex_t *regex) {
-    bool matched = false;
+// -E patterns are also compiled into a DFA of our own, built lazily (a state at a time, as
+// the input needs it) from a Thompson NFA. It only tells us whether a line matches, not
+// where, but its whole state is one int: a line can be fed to it in pieces of any size and
+// a match is seen as soon as its last byte arrives. That lets -E search long lines a piece
+// at a time (see scan_long_line), and it rejects lines much faster than regexec() does.
+// regexec() is still used to find match spans (--color, json and binary output), and for
+// patterns using anything the DFA doesn't do (back references, \w, \<, [= =] and the like),
+// which sre_compile() turns down.
+//
+// The syntax is regcomp()'s without REG_EXTENDED (POSIX basic regex with the GNU \+ \? and
+// \| extensions), in the "C" locale
+#define SRE_MAX_NODES 8192		// NFA size limit (\{m,n\} makes n copies of its atom)
+#define SRE_MAX_REPEAT 255		// largest count in \{m,n\}, as RE_DUP_MAX
+#define SRE_MAX_STATES 512		// DFA states kept before the cache is cleared (more if huge pages leave room)
 
-// +++++++++++
-// Handle -E: 2of2: use regex
-// +++++++++++
-    if (opts->use_regex) {
-        // Use regex
-        matched = (regexec(regex, line, 0, NULL, 0) == 0);
-    } else if (opts->ignore_case) {
+typedef enum {
+    RN_SET,		// read a byte in sets[set], then go to out
+    RN_SPLIT,	// go to both out and out1
+    RN_EMPTY,	// go to out
+    RN_BOL,		// ^: go to out at the start of the line
+    RN_EOL,		// $: go to out at the end of the line
+    RN_MATCH
+} ReNodeType;
 
-// +++++++++++
-// Handle -i: 3of3: convert line to lower case. pattern will already be correct (see 1of2)
-// +++++++++++
-        char lower_line[MAX_LINE_LEN];
-        strncpy(lower_line, line, sizeof(lower_line)-1);
-        lower_line[sizeof(lower_line)-1] = '\0';
-        for (char *p = lower_line; *p; p++) *p = tolower((unsigned char)*p);
-        matched = strstr(lower_line, opts->pattern) != NULL;
-    } else {
-        matched = strstr(line, opts->pattern) != NULL;
+typedef struct {
+    ReNodeType type;
+    int out;
+    int out1;
+    int set;
+} ReNode;
+
+typedef struct {
+    uint64_t bits[4];
+} ByteSet;
+
+// a piece of NFA with one way in and one way out: end is an RN_EMPTY node whose out is
+// filled in when the piece is joined to whatever follows it
+typedef struct {
+    int start;
+    int end;
+} ReFrag;
+
+typedef struct {
+    int *members;		// NFA nodes in the state (RN_SET, RN_EOL and RN_MATCH only), sorted
+    int count;
+    unsigned hash;
+    bool accept;		// a match has just ended
+    bool accept_eol;	// a match ends if the line ends here
+    int next[256];		// the state after each byte (-1: not worked out yet)
+} DfaState;
+
+struct StreamRegex {
+    ReNode *nodes;
+    int node_count;
+    int node_cap;
+    ByteSet *sets;
+    int set_count;
+    int set_cap;
+    int start;			// first NFA node
+    bool icase;
+
+    // parser
+    const char *pat;
+    size_t pos;
+    size_t len;
+    bool failed;		// the pattern uses something we don't handle
+    int anchors;		// ^ and $ anchors parsed so far
+
+    // DFA cache. State 0 is always the state at the start of a line
+    DfaState *states;
+    int state_count;
+    int max_states;		// room in states
+    int kept_states;	// states kept when the cache is cleared: 0 and restart
+    unsigned clears;	// times the cache has been cleared
+    bool empty_line_matches;
+    int restart;		// the state with no match under way (after the start of the line)
+    int skip_byte;		// the only byte that leaves restart, or -1: memchr() can skip to it
+
+    // scratch for building states, SRE_MAX_NODES each
+    int *mark;			// mark[n] == mark_gen: node n is already in the set being built
+    int mark_gen;
+    int *stack;
+    int *list;
+    int *src;
+};
+
+bool byteset_has(const ByteSet *s, unsigned char c) {
+    return (s->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+void byteset_add(ByteSet *s, unsigned char c) {
+    s->bits[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+int sre_node(StreamRegex *re, ReNodeType type, int out, int out1) {
+    if (re->node_count == SRE_MAX_NODES) {
+        re->failed = true;
+        return 0;
+    }
+    if (re->node_count == re->node_cap) {
+        re->node_cap = re->node_cap ? re->node_cap * 2 : 64;
+        re->nodes = xrealloc(re->nodes, (size_t)re->node_cap * sizeof(ReNode));
     }
+    re->nodes[re->node_count] = (ReNode){type, out, out1, -1};
+    return re->node_count++;
+}
 
-// +++++++++++
-// Handle -v: return lines that do NOT match
-// +++++++++++
-    return opts->reverse_find ? !matched : matched;
+// a fragment that does nothing, or just checks an anchor
+ReFrag sre_frag(StreamRegex *re, ReNodeType type) {
+    int end = sre_node(re, RN_EMPTY, -1, -1);
+    if (type == RN_EMPTY) return (ReFrag){end, end};
+    return (ReFrag){sre_node(re, type, end, -1), end};
 }
 
-// ------------------ Helper for appending to a string ---------
-void append_to_buffer(char *buf, size_t bufsize, const char *fmt, ...) {
-    if (bufsize == 0) return;  // nothing to do
+// -i: add the other case of every letter in the set
+void byteset_fold(ByteSet *set) {
+    for (int c = 0; c < 256; c++) {
+        if (!byteset_has(set, (unsigned char)c)) continue;
+        byteset_add(set, (unsigned char)tolower(c));
+        byteset_add(set, (unsigned char)toupper(c));
+    }
+}
 
-    size_t len = strlen(buf);
-    if (len >= bufsize - 1) return;  // no space left
+// a fragment that reads one byte in set
+ReFrag sre_set_frag(StreamRegex *re, ByteSet set) {
+    if (re->set_count == re->set_cap) {
+        re->set_cap = re->set_cap ? re->set_cap * 2 : 16;
+        re->sets = xrealloc(re->sets, (size_t)re->set_cap * sizeof(ByteSet));
+    }
+    re->sets[re->set_count] = set;
+    ReFrag f = sre_frag(re, RN_EMPTY);
+    f.start = sre_node(re, RN_SET, f.end, -1);
+    if (!re->failed) re->nodes[f.start].set = re->set_count++;
+    return f;
+}
 
-    va_list ap;
-    va_start(ap, fmt);
-    // buf+len starts appending after any existing buffer content
-    // bufsize-len ensures we don't write over the total buffer size
-    int n = vsnprintf(buf + len, bufsize - len, fmt, ap);
-    va_end(ap);
+ReFrag sre_byte_frag(StreamRegex *re, unsigned char c) {
+    ByteSet set = {{0}};
+    byteset_add(&set, c);
+    if (re->icase) byteset_fold(&set);
+    return sre_set_frag(re, set);
+}
 
-    // n is chars written - kept for potential debugging. even if n is less than intended
-    // (i.e. bufsize - len), vsnprintf will still null terminate the string (i.e. buf)
-    UNUSED(n);
+ReFrag sre_concat(StreamRegex *re, ReFrag a, ReFrag b) {
+    if (re->failed) return a;
+    re->nodes[a.end].out = b.start;
+    return (ReFrag){a.start, b.end};
 }
 
-// -----------------------------------------------------
-// ------------------ Helper for stripping filename ---------
-// -----------------------------------------------------
-const char *get_basename(const char *path){
-    if (path == NULL) return NULL;
+ReFrag sre_alt(StreamRegex *re, ReFrag a, ReFrag b) {
+    int start = sre_node(re, RN_SPLIT, a.start, b.start);
+    int end = sre_node(re, RN_EMPTY, -1, -1);
+    if (re->failed) return a;
+    re->nodes[a.end].out = end;
+    re->nodes[b.end].out = end;
+    return (ReFrag){start, end};
+}
 
-    const char *last = strrchr(path, '/');
-    if (last) return last + 1;  // character after last '/'
-    return path;    	      	// no slash, whole string is filename
+// a*  (or a\? if !loop, a\+ if !skip)
+ReFrag sre_repeat(StreamRegex *re, ReFrag a, bool skip, bool loop) {
+    int end = sre_node(re, RN_EMPTY, -1, -1);
+    int split = sre_node(re, RN_SPLIT, a.start, end);
+    if (re->failed) return a;
+    re->nodes[a.end].out = loop ? split : end;
+    return (ReFrag){skip ? split : a.start, end};
 }
 
-// -----------------------------------------------------
-// ------------------ Helper for Line Printing ---------
-// -----------------------------------------------------
-void print_line(const char *filename, const char *line, int lineno,
-                int max_chars, int crop_chars, bool show_line_nums, bool show_fname)
-{
-    char buffer[MAX_LINE_LEN];  // should be at least as large as your fgets buffer
-	char line_expanded[MAX_LINE_LEN]; // buffer for tab expansion
-	char *line_to_print;		// final modified line
-	size_t len;					// length of the modified buffer line
-
-    // Make a local copy of line to safely modify & null terminate for safety
-    strncpy(buffer, line, sizeof(buffer)-1);
-    buffer[sizeof(buffer)-1] = '\0';
-    
-    // Strip trailing newline if present - we don't want to duplicate this later
-    len = strlen(buffer);
-    if (len > 0 && buffer[len-1] == '\n') {
-        buffer[len-1] = '\0';
-        len--;
-    }
-
-    // Expand tabs safely - extra spaces to tab stop
-    size_t out = 0;
-    int col = 0;
-    for (size_t i = 0; buffer[i] != '\0' && out < sizeof(line_expanded)-1; i++) {
-        if (buffer[i] == '\t') {
-        	// expand tab 
-            int spaces = TAB_WIDTH - (col % TAB_WIDTH); // i.e. spaces to next tab stop
-            for (int s = 0; s < spaces && out < sizeof(line_expanded)-1; s++) {
-                line_expanded[out++] = ' ';
-                col++;
+bool sre_peek(const StreamRegex *re, const char *s) {
+    size_t n = strlen(s);
+    return re->len - re->pos >= n && memcmp(re->pat + re->pos, s, n) == 0;
+}
+
+// [...] bracket expression; pos is just after the '['
+// the bytes [...] matches, parsed from just after the [ (the trigram planner uses this too)
+ByteSet sre_bracket_set(StreamRegex *re) {
+    static const struct { const char *name; int (*is)(int); } classes[] = {
+        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"upper", isupper},
+        {"lower", islower}, {"space", isspace}, {"blank", isblank}, {"punct", ispunct},
+        {"print", isprint}, {"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit}
+    };
+    ByteSet set = {{0}};
+    bool negate = false;
+    if (sre_peek(re, "^")) {
+        negate = true;
+        re->pos++;
+    }
+    bool first = true;
+    for (;;) {
+        if (re->pos >= re->len) {
+            re->failed = true;
+            break;
+        }
+        unsigned char c = (unsigned char)re->pat[re->pos];
+        if (c == ']' && !first) {
+            re->pos++;
+            break;
+        }
+        first = false;
+        if (sre_peek(re, "[:")) {
+            const char *close = memmem(re->pat + re->pos + 2, re->len - re->pos - 2, ":]", 2);
+            size_t n = close ? (size_t)(close - (re->pat + re->pos + 2)) : 0;
+            int (*is)(int) = NULL;
+            for (size_t i = 0; close && i < sizeof(classes) / sizeof(classes[0]); i++) {
+                if (strlen(classes[i].name) == n && memcmp(classes[i].name, re->pat + re->pos + 2, n) == 0)
+                    is = classes[i].is;
+            }
+            // with -i, regcomp() decides [:upper:] / [:lower:] differently to us: leave it to it
+            if (!is || (re->icase && (is == isupper || is == islower))) {
+                re->failed = true;
+                break;
+            }
+            for (int b = 0; b < 256; b++) if (is(b)) byteset_add(&set, (unsigned char)b);
+            re->pos += 2 + n + 2;
+            continue;
+        }
+        if (sre_peek(re, "[.") || sre_peek(re, "[=")) {
+            re->failed = true;
+            break;
+        }
+        re->pos++;
+        unsigned char hi = c;
+        if (re->pos + 1 < re->len && re->pat[re->pos] == '-' && re->pat[re->pos + 1] != ']') {
+            hi = (unsigned char)re->pat[re->pos + 1];
+            if (hi == '[' || hi < c) {
+                re->failed = true;
+                break;
             }
+            re->pos += 2;
+        }
+        for (int b = c; b <= hi; b++) byteset_add(&set, (unsigned char)b);
+    }
+    if (re->icase) byteset_fold(&set);	// before negating: [^a] with -i matches neither a nor A
+    if (negate) {
+        for (int i = 0; i < 4; i++) set.bits[i] = ~set.bits[i];
+    }
+    return set;
+}
+
+ReFrag sre_bracket(StreamRegex *re) {
+    return sre_set_frag(re, sre_bracket_set(re));
+}
+
+ReFrag sre_alternation(StreamRegex *re);
+
+// one atom: a byte, ., [...] or \(...\). Returns false at the end of a branch
+bool sre_atom(StreamRegex *re, ReFrag *f, bool at_start) {
+    unsigned char c = (unsigned char)re->pat[re->pos];
+    if (c == '\\') {
+        if (re->pos + 1 >= re->len) {
+            re->failed = true;
+            return false;
+        }
+        unsigned char e = (unsigned char)re->pat[re->pos + 1];
+        if (e == ')' || e == '|') return false;
+        re->pos += 2;
+        if (e == '(') {
+            *f = sre_alternation(re);
+            if (!sre_peek(re, "\\)")) re->failed = true;
+            re->pos += 2;
+        } else if (isalnum(e) || e == '{' || e == '}' || e == '+' || e == '?' || e == '<' ||
+                   e == '>' || e == '`' || e == '\'') {
+            re->failed = true;	// back reference, \w, \b ... or an operator with nothing to apply to
         } else {
-        	// no tab to expand
-            line_expanded[out++] = buffer[i];
-            col++;
+            *f = sre_byte_frag(re, e);
         }
+        return true;
     }
-    line_expanded[out] = '\0'; 		//terminate the expanded line 
-    line_to_print = line_expanded;	//make this the line to print
-    len = out;						// reset len
+    re->pos++;
+    if (c == '.') {
+        ByteSet any;
+        memset(&any, 0xFF, sizeof(any));
+        any.bits[0] &= ~(uint64_t)1;	// . doesn't match NUL
+        *f = sre_set_frag(re, any);
+    } else if (c == '[') {
+        *f = sre_bracket(re);
+    } else if (c == '*' && !at_start) {
+        re->failed = true;	// a repeat is handled by the caller; we only get here for a*** in odd places
+    } else {
+        *f = sre_byte_frag(re, c);
+    }
+    return true;
+}
 
-// +++++++++++
-// Handle -L: crop the start of the line 
-// +++++++++++
-	if (crop_chars> 0 ) {
-		if (len > (size_t)crop_chars) line_to_print = line_to_print + crop_chars;
-		else line_to_print = "";
-	}
+// atoms and their repeats, up to \| or \) or the end
+ReFrag sre_branch(StreamRegex *re) {
+    ReFrag branch = sre_frag(re, RN_EMPTY);
+    bool at_start = true;		// ^ and a leading * are special here
 
-// +++++++++++
-// Handle -l: Adjust max_chars if the line is shorter than the max specified 
-// +++++++++++
-    if ((size_t)max_chars > len)  max_chars = (int)len;
+    if (sre_peek(re, "^")) {
+        re->pos++;
+        re->anchors++;
+        branch = sre_concat(re, branch, sre_frag(re, RN_BOL));
+    }
+    while (re->pos < re->len && !re->failed) {
+        // $ is an anchor only at the end of a branch
+        if (re->pat[re->pos] == '$' && (re->pos + 1 == re->len || sre_peek(re, "$\\)") || sre_peek(re, "$\\|"))) {
+            re->pos++;
+            re->anchors++;
+            branch = sre_concat(re, branch, sre_frag(re, RN_EOL));
+            continue;
+        }
+        size_t atom_pos = re->pos;
+        int anchors = re->anchors;
+        ReFrag atom;
+        if (!sre_atom(re, &atom, at_start)) break;
+        at_start = false;
+        bool repeated = false;
 
-// +++++++++++
-// Handle -f: Print with optional file name prefix
-// +++++++++++
-    char prefix[256]; prefix[0] = '\0';
-	if (show_fname) append_to_buffer(prefix, sizeof(prefix), "%s:", get_basename(filename));
+        // repeats: *, \+, \?, \{m,n\}
+        for (;;) {
+            if (sre_peek(re, "*")) {
+                re->pos++;
+                atom = sre_repeat(re, atom, true, true);
+            } else if (sre_peek(re, "\\+")) {
+                re->pos += 2;
+                atom = sre_repeat(re, atom, false, true);
+            } else if (sre_peek(re, "\\?")) {
+                re->pos += 2;
+                atom = sre_repeat(re, atom, true, false);
+            } else if (sre_peek(re, "\\{")) {
+                re->pos += 2;
+                char *end;
+                long lo = strtol(re->pat + re->pos, &end, 10);
+                long hi = lo;
+                if (end == re->pat + re->pos || repeated) {
+                    re->failed = true;	// \{,n\} or a*\{n\}: copies are made by parsing the atom again
+                    break;
+                }
+                if (*end == ',') {
+                    char *p = end + 1;
+                    hi = isdigit((unsigned char)*p) ? strtol(p, &end, 10) : -1;
+                    if (hi < 0) end = p;
+                }
+                if (strncmp(end, "\\}", 2) != 0 || lo > SRE_MAX_REPEAT || hi > SRE_MAX_REPEAT || (hi >= 0 && hi < lo)) {
+                    re->failed = true;
+                    break;
+                }
+                size_t after = (size_t)(end + 2 - re->pat);
 
-// +++++++++++
-// Handle -n: Print with optional line numbers prefix
-// +++++++++++
-	if (show_line_nums) append_to_buffer(prefix, sizeof(prefix), "%04d:", lineno);
-	
-	// and print the modified line up to max chars in length (+ any prefix)
-    printf("%s%.*s\n", prefix, max_chars, line_to_print);
+                // lo copies, then (hi - lo) optional ones or a star. Each copy is made by
+                // parsing the atom again
+                ReFrag rep = sre_frag(re, RN_EMPTY);
+                for (long i = 0; i < (hi < 0 ? lo + 1 : hi) && !re->failed; i++) {
+                    ReFrag copy = atom;
+                    if (i > 0) {
+                        re->pos = atom_pos;
+                        sre_atom(re, &copy, false);
+                    }
+                    if (i >= lo) copy = sre_repeat(re, copy, true, hi < 0);
+                    rep = sre_concat(re, rep, copy);
+                }
+                re->pos = after;
+                atom = rep;
+            } else {
+                break;
+            }
+            repeated = true;
+            // regcomp() lets a repeated \(^a\) match "aa": not something to copy
+            if (re->anchors > anchors) re->failed = true;
+        }
+        branch = sre_concat(re, branch, atom);
+    }
+    return branch;
 }
 
+ReFrag sre_alternation(StreamRegex *re) {
+    ReFrag f = sre_branch(re);
+    while (!re->failed && sre_peek(re, "\\|")) {
+        re->pos += 2;
+        f = sre_alt(re, f, sre_branch(re));
+    }
+    return f;
+}
 
-// -----------------------------------------------------
-// ------------------ File Processing ------------------
-// -----------------------------------------------------
+void sre_free(StreamRegex *re) {
+    if (!re) return;
+    for (int i = 0; i < re->state_count; i++) free(re->states[i].members);
+    big_free(re->states, (size_t)re->max_states * sizeof(DfaState));
+    free(re->nodes);
+    free(re->sets);
+    free(re->mark);
+    free(re->stack);
+    free(re->list);
+    free(re->src);
+    free(re);
+}
 
-// we'll use this structure to store previous lines for the -b option
-typedef struct {
-    int lineno;
-    char *line;
-} BeforeLine;
+// add node n, and everything it leads to without reading a byte, to re->list. bol / eol say
+// whether ^ / $ hold here. Only nodes that read a byte, $ (when it doesn't hold) and the
+// match are kept: they are all a DFA state needs
+void sre_closure(StreamRegex *re, int n, bool bol, bool eol, int *count) {
+    int sp = 0;
+    re->stack[sp++] = n;
+    while (sp > 0) {
+        n = re->stack[--sp];
+        if (n < 0 || re->mark[n] == re->mark_gen) continue;
+        re->mark[n] = re->mark_gen;
+        const ReNode *node = &re->nodes[n];
+        switch (node->type) {
+            case RN_SPLIT:
+                re->stack[sp++] = node->out1;
+                re->stack[sp++] = node->out;
+                break;
+            case RN_EMPTY:
+                re->stack[sp++] = node->out;
+                break;
+            case RN_BOL:
+                if (bol) re->stack[sp++] = node->out;
+                break;
+            case RN_EOL:
+                if (eol) re->stack[sp++] = node->out;
+                else re->list[(*count)++] = n;
+                break;
+            default:
+                re->list[(*count)++] = n;
+        }
+    }
+}
 
-void process_file(FILE *fp, const char *filename, const Options *opts, const regex_t *regex) {
-// +++++++++++
-// Handle -b: 1of3: create a buffer to capture rolling set of previous lines
-// +++++++++++
-    int before_size = opts->before;
-    BeforeLine *before_buf = NULL;
-	char (*before_storage)[MAX_LINE_LEN] = NULL;
-	// allocate full before-line buffer
-	if (before_size > 0) {
-		before_buf = xcalloc(before_size, sizeof(BeforeLine));
-		before_storage = xcalloc(before_size, MAX_LINE_LEN);
-		for (int i = 0; i < before_size; i++) {
-			before_buf[i].line = before_storage[i];
-			before_buf[i].lineno = 0;
-		}
-	}
+// would a match end if the line ended with the DFA in a state with these members?
+bool sre_accepts_at_eol(StreamRegex *re, const int *members, int count, bool bol) {
+    int n = 0;
+    re->mark_gen++;
+    for (int i = 0; i < count; i++) {
+        if (re->nodes[members[i]].type == RN_EOL) sre_closure(re, re->nodes[members[i]].out, bol, true, &n);
+        else if (re->nodes[members[i]].type == RN_MATCH) return true;
+    }
+    for (int i = 0; i < n; i++) if (re->nodes[re->list[i]].type == RN_MATCH) return true;
+    return false;
+}
 
-    char *line = NULL;	
-    size_t line_len = 0;
-    int lineno = 1;
-    int after_counter = 0;
-    int buf_pos = 0;
-    int buf_count = 0; // number of valid lines in circular buffer
-    int match_count = 0;
+int sre_cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
 
-// +++++++++++
-// Handle -F: show file name headers before the matched lines. 
-// +++++++++++
-	if(opts->filename_title) printf(
-		"\n----------------------\nFile: %s\n----------------------\n", filename);
+// the DFA state for the set of nodes in re->list[0..count), added to the cache if it isn't
+// there. If the cache is full it is cleared first (keeping state 0), so a pattern with a huge
+// DFA still runs in fixed memory, just more slowly
+int sre_state(StreamRegex *re, int count) {
+    qsort(re->list, (size_t)count, sizeof(int), sre_cmp_int);
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < count; i++) hash = (hash ^ (unsigned)re->list[i]) * 16777619u;
+    for (int i = 0; i < re->state_count; i++) {
+        DfaState *st = &re->states[i];
+        if (st->hash == hash && st->count == count && memcmp(st->members, re->list, (size_t)count * sizeof(int)) == 0)
+            return i;
+    }
 
-    while (getline(&line, &line_len, fp) != -1) {
-        bool match = line_contains(line, opts, regex);
+    if (re->state_count == re->max_states) {
+        for (int i = re->kept_states; i < re->state_count; i++) free(re->states[i].members);
+        re->state_count = re->kept_states;
+        re->clears++;
+        for (int i = 0; i < re->kept_states; i++)
+            for (int c = 0; c < 256; c++) re->states[i].next[c] = -1;
+    }
+    DfaState *st = &re->states[re->state_count];
+    st->members = xmalloc((size_t)(count > 0 ? count : 1) * sizeof(int));
+    memcpy(st->members, re->list, (size_t)count * sizeof(int));
+    st->count = count;
+    st->hash = hash;
+    st->accept = false;
+    for (int i = 0; i < count; i++) if (re->nodes[re->list[i]].type == RN_MATCH) st->accept = true;
+    st->accept_eol = sre_accepts_at_eol(re, st->members, count, false);
+    for (int c = 0; c < 256; c++) st->next[c] = -1;
+    return re->state_count++;
+}
 
-        // --- handle match ---
-        if (match) {
-// +++++++++++
-// Handle -m: 2of2: ONLY show file names where there are matches (not the matched lines). 
-// +++++++++++
-			if(opts->filename_only) {
-				printf("Match Found In: %s\n", filename);
-				return; // this is safe as -m turns off -b (no buffer cleanup needed) see 1of2
-				}
+// work out (and cache) the state after reading byte c in state s
+int sre_step(StreamRegex *re, int s, unsigned char c) {
+    // copy the members out: adding the new state may clear the cache
+    int n = re->states[s].count;
+    memcpy(re->src, re->states[s].members, (size_t)n * sizeof(int));
 
-			// without the -m option we process every line
-            match_count++;
+    int count = 0;
+    re->mark_gen++;
+    for (int i = 0; i < n; i++) {
+        const ReNode *node = &re->nodes[re->src[i]];
+        if (node->type == RN_SET && byteset_has(&re->sets[node->set], c))
+            sre_closure(re, node->out, false, false, &count);
+    }
+    // a match can start at any byte
+    sre_closure(re, re->start, false, false, &count);
 
-// +++++++++++
-// Handle -c: 1of3: don't print before lines if match count requested
-// +++++++++++
-// Handle -b: 2of3: print n lines from before the match; or as many as the buffer has
-// +++++++++++
-            // print before lines in chronological order
-            // this uses a circular buffer of size specified in the -b option
-			if (before_size > 0 && !opts->count_only ) { // only do this if there's a buffer or the mod can throw a runtime error
-				printf("---\n");
-				int start = (buf_pos + (before_size - buf_count)) % before_size;
-				for (int i = 0; i < buf_count; i++) {
-					int idx = (start + i) % before_size;
-					if (before_buf[idx].line) {
-						print_line(filename, before_buf[idx].line, before_buf[idx].lineno, 
-							opts->line_limit, opts->line_crop, opts->show_line_numbers, opts->show_filename);
-					}
-				}
-			}
+    unsigned clears = re->clears;
+    int next = sre_state(re, count);
+    if (re->clears == clears) re->states[s].next[c] = next;
+    return next;
+}
 
-// +++++++++++
-// Handle -a: 1of2: set point from which we print n lines after the match; or as many as there are left in the file
-// +++++++++++
-            // set after-counter for printing lines after this match
-            after_counter = opts->after;
-        } 
+// compile pattern for the DFA. Returns NULL if it uses something the DFA doesn't do
+StreamRegex *sre_compile(const char *pattern, bool icase) {
+    StreamRegex *re = xcalloc(1, sizeof(StreamRegex));
+    re->pat = pattern;
+    re->len = strlen(pattern);
+    re->icase = icase;
 
-	// end of "if match" logic (still in while loop)
+    ReFrag f = sre_alternation(re);
+    if (re->pos < re->len) re->failed = true;	// a \) with no \(
+    int match = sre_node(re, RN_MATCH, -1, -1);
+    if (re->failed) {
+        sre_free(re);
+        return NULL;
+    }
+    re->nodes[f.end].out = match;
+    re->start = f.start;
 
-// +++++++++++
-// Handle -c: 2of3: don't print after lines if match count requested
-// +++++++++++
-// Handle -a: 2of2: continue to print lines after the match until the counter runs down
-// +++++++++++
-        // --- print current line if match OR after-counter active ---
-        if ((match || after_counter > 0) && !opts->count_only){
-			print_line(filename, line, lineno, 
-				opts->line_limit, opts->line_crop, opts->show_line_numbers, opts->show_filename);
-            // decrement after-counter only for non-match lines 
-            if (!match && after_counter > 0) {
-                after_counter--;
-            	// when we come to the end of the after lines print a terminater
-            	if (after_counter == 0) printf("+++\n");
-            }
-        }
+    re->mark = xcalloc((size_t)re->node_count, sizeof(int));
+    re->stack = xmalloc((size_t)(2 * re->node_count + 2) * sizeof(int));
+    re->list = xmalloc((size_t)re->node_count * sizeof(int));
+    re->src = xmalloc((size_t)re->node_count * sizeof(int));
+    // a smaller cache (cleared more often) if --max-memory is tight
+    size_t states_size = SRE_MAX_STATES * sizeof(DfaState);
+    while (states_size > 16 * sizeof(DfaState) && !mem_fits(states_size)) states_size /= 2;
+    re->states = big_alloc(&states_size);
+    re->max_states = (int)(states_size / sizeof(DfaState));
 
-// +++++++++++
-// Handle -b: 3of3: push each line into the buffer (curcular) so historical lines can be printed 
-// +++++++++++
-        // --- update circular buffer for "before" lines ---
-        if (before_size > 0) {
-			strncpy(before_buf[buf_pos].line, line, MAX_LINE_LEN - 1);
-			before_buf[buf_pos].line[MAX_LINE_LEN - 1] = '\0';
-			before_buf[buf_pos].lineno = lineno;
-            buf_pos = (buf_pos + 1) % before_size;
-            if (buf_count < before_size) buf_count++;
-        }
-        
-        lineno++;
+    // state 0: the start of a line, where ^ holds
+    int count = 0;
+    re->mark_gen++;
+    sre_closure(re, re->start, true, false, &count);
+    sre_state(re, count);
+    re->empty_line_matches = sre_accepts_at_eol(re, re->states[0].members, re->states[0].count, true);
+
+    // the restart state (the same as state 0 unless the pattern has a ^). Most bytes of most
+    // lines are read in it; if only one byte can move it on, memchr() finds that byte faster
+    count = 0;
+    re->mark_gen++;
+    sre_closure(re, re->start, false, false, &count);
+    re->restart = sre_state(re, count);
+    re->kept_states = re->state_count;
+    re->skip_byte = -1;
+    ByteSet leave = {{0}};
+    bool can_skip = true;
+    for (int i = 0; i < count; i++) {
+        const ReNode *node = &re->nodes[re->states[re->restart].members[i]];
+        if (node->type != RN_SET) can_skip = false;
+        else for (int w = 0; w < 4; w++) leave.bits[w] |= re->sets[node->set].bits[w];
     }
+    int nleave = 0;
+    for (int c = 0; c < 256; c++) {
+        if (!byteset_has(&leave, (unsigned char)c)) continue;
+        nleave++;
+        re->skip_byte = c;
+    }
+    if (!can_skip || nleave != 1) re->skip_byte = -1;
+    return re;
+}
 
-// +++++++++++
-// Handle -c: 3of3: print match count if requested
-// +++++++++++
-    if (opts->count_only) {
-        printf("%s:%d\n", get_basename(filename), match_count);
+// feed p[0..n) to the DFA, starting in *state (0 at the start of a line). Returns true as
+// soon as the last byte of a match is read, without looking at the rest
+bool sre_feed(StreamRegex *re, int *state, const char *p, size_t n) {
+    const unsigned char *u = (const unsigned char *)p;
+    int s = *state;
+    if (re->states[s].accept) return true;
+    for (size_t i = 0; i < n; i++) {
+        if (s == re->restart && re->skip_byte >= 0) {
+            const unsigned char *hit = memchr(u + i, re->skip_byte, n - i);
+            if (!hit) break;
+            i = (size_t)(hit - u);
+        }
+        int next = re->states[s].next[u[i]];
+        s = next >= 0 ? next : sre_step(re, s, u[i]);
+        if (re->states[s].accept) {
+            *state = s;
+            return true;
+        }
     }
+    *state = s;
+    return false;
+}
 
-    // --- cleanup buffer ---
-    free(line);
-	if (before_buf) free(before_buf);
-	if (before_storage) free(before_storage);
+// the line has ended in state (having had len bytes, none of them ending a match): is
+// there a match that ends with the line (a $ at the end of the pattern)?
+bool sre_end(const StreamRegex *re, int state, size_t len) {
+    return len == 0 ? re->empty_line_matches : re->states[state].accept_eol;
+}
+
+// does line[0..len) contain a match?
+bool sre_line_matches(StreamRegex *re, const char *line, size_t len) {
+    int state = 0;
+    return sre_feed(re, &state, line, len) || sre_end(re, state, len);
 }
 
 
+
 // -----------------------------------------------------
-// ------------------ Main ------------------
+// ------------------ SIMD byte scan ---------
 // -----------------------------------------------------
-int main(int argc, char *argv[]) {
-    Options opts; // this is our full options list if values
-    int first_file_index;	
-    regex_t regex;
-	int regex_compiled = 0; // flag to know if we need to free
+// Return a pointer to the first c in p[0..n), or NULL. Checks 16 bytes per step
+// where the target has SSE2 (x86-64) or NEON (arm64); anything else uses the plain loop
+const char *find_byte(const char *p, size_t n, char c) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask) return p + i + __builtin_ctz((unsigned)mask);
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t needle = vdupq_n_u8((uint8_t)c);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)(p + i)), needle);
+        if (vmaxvq_u8(eq)) break;	// it's in this block - the loop below finds exactly where
+    }
+#endif
+    for (; i < n; i++) if (p[i] == c) return p + i;
+    return NULL;
+}
+
+// the same for the first byte that is either a or b (the two cases of a letter, for -i)
+const char *find_either_byte(const char *p, size_t n, char a, char b) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i na = _mm_set1_epi8(a);
+    const __m128i nb = _mm_set1_epi8(b);
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(block, na), _mm_cmpeq_epi8(block, nb));
+        int mask = _mm_movemask_epi8(eq);
+        if (mask) return p + i + __builtin_ctz((unsigned)mask);
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t na = vdupq_n_u8((uint8_t)a);
+    const uint8x16_t nb = vdupq_n_u8((uint8_t)b);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t block = vld1q_u8((const uint8_t *)(p + i));
+        uint8x16_t eq = vorrq_u8(vceqq_u8(block, na), vceqq_u8(block, nb));
+        if (vmaxvq_u8(eq)) break;	// it's in this block - the loop below finds exactly where
+    }
+#endif
+    for (; i < n; i++) if (p[i] == a || p[i] == b) return p + i;
+    return NULL;
+}
+
+
+// -----------------------------------------------------
+// ------------------ Pattern ------------------
+// -----------------------------------------------------
+// The search pattern, built once in main and only read after that: its exact bytes (any
+// length, and with -x any values, NUL included), the -i folded form, and the tables the
+// literal search uses, so nothing about the pattern is worked out again per line.
+// A literal search scans for the pattern byte least likely to be in the text (a SIMD scan
+// for one byte, or either case of it for -i) and compares the whole pattern only where that
+// byte turns up. If every byte is common, memmem() does better (though not for -i, which
+// has nothing like it). If the one picked turns up too often anyway, the rest of the line is
+// searched with memmem(), or for -i a Horspool search with the skip table
+#define RARE_MISS_GAP 16	// a false hit every this many bytes or less: the rare byte isn't
+#define RARE_MAX 150		// byte_frequency above this: not worth scanning for
+
+struct Pattern {
+    char *bytes;		// the pattern as given, NUL terminated too (for regcomp)
+    size_t len;
+    bool icase;			// -i (and not -E)
+    char *folded;		// -i: bytes in lower case; otherwise the same as bytes
+    unsigned char fold[256];	// each byte as it is compared: lower case for -i, else itself
+    size_t rare;		// index in folded of the byte scanned for
+    bool scan_rare;		// it's worth scanning for (else memmem); always for -i
+    char rare_alt;		// -i: the other case of folded[rare] (or the same byte)
+    size_t shift[256];	// Horspool: how far the window moves when its last byte folds to c
+};
+
+// a rough guess at how common byte c is in text and source code, used to pick the pattern
+// byte to scan for. Higher is more common
+int byte_frequency(unsigned char c) {
+    static const char letters[] = "etaoinsrhldcumfpgwybvkxjqz";	// most common first
+    if (c == ' ') return 255;
+    if (isalpha(c)) {
+        int rank = (int)(strchr(letters, tolower(c)) - letters);
+        return islower(c) ? 240 - 4 * rank : 120 - 2 * rank;
+    }
+    if (isdigit(c)) return 90;
+    if (c && strchr("(){}[];,.=_-\"'*/:<>#&|+!", c)) return 70;
+    if (c == '\t') return 60;
+    if (isprint(c)) return 40;
+    return c >= 0x80 ? 20 : 5;	// UTF-8 bytes, then control bytes
+}
+
+// the pattern from its command line argument: the bytes as given, or with -x pairs of hex
+// digits (spaces between them are skipped). Exits if the hex isn't valid
+Pattern *pattern_build(const char *arg, bool hex, bool icase) {
+    Pattern *pat = xcalloc(1, sizeof(Pattern));
+    size_t n = strlen(arg);
+    pat->bytes = xmalloc(n + 1);
+    if (!hex) {
+        memcpy(pat->bytes, arg, n);
+        pat->len = n;
+    } else {
+// +++++++++++
+// Handle -x: 1of2: the pattern is hex, so it can hold bytes the command line can't (NUL)
+// +++++++++++
+        for (const char *p = arg; *p; ) {
+            if (isspace((unsigned char)*p)) {
+                p++;
+                continue;
+            }
+            if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1])) {
+                fprintf(stderr, "Invalid -x pattern: %s (use pairs of hex digits)\n", arg);
+                exit(EXIT_FAILURE);
+            }
+            char digits[3] = {p[0], p[1], '\0'};
+            pat->bytes[pat->len++] = (char)strtol(digits, NULL, 16);
+            p += 2;
+        }
+    }
+    pat->bytes[pat->len] = '\0';
+
+// +++++++++++
+// Handle -i: 1of3: compare in lower case: fold the pattern once here, and the text as it is
+// compared (see pattern_find)
+// +++++++++++
+    pat->icase = icase;
+    for (int c = 0; c < 256; c++) pat->fold[c] = (unsigned char)(icase ? tolower(c) : c);
+    pat->folded = pat->bytes;
+    if (icase) {
+        pat->folded = xmalloc(pat->len + 1);
+        for (size_t i = 0; i <= pat->len; i++)
+            pat->folded[i] = (char)pat->fold[(unsigned char)pat->bytes[i]];
+    }
+
+    // the byte to scan for: under -i a letter is as common as both its cases together
+    int best = INT_MAX;
+    for (size_t i = 0; i < pat->len; i++) {
+        unsigned char c = (unsigned char)pat->folded[i];
+        int f = byte_frequency(c);
+        if (icase && toupper(c) != c) f += byte_frequency((unsigned char)toupper(c));
+        if (f < best) {
+            best = f;
+            pat->rare = i;
+        }
+    }
+    pat->scan_rare = icase || best <= RARE_MAX;
+    unsigned char r = pat->len ? (unsigned char)pat->folded[pat->rare] : 0;
+    pat->rare_alt = (char)(icase ? toupper(r) : r);
+
+    for (int c = 0; c < 256; c++) pat->shift[c] = pat->len;
+    for (size_t i = 0; i + 1 < pat->len; i++)
+        pat->shift[(unsigned char)pat->folded[i]] = pat->len - 1 - i;
+    return pat;
+}
+
+void pattern_free(Pattern *pat) {
+    if (!pat) return;
+    if (pat->folded != pat->bytes) free(pat->folded);
+    free(pat->bytes);
+    free(pat);
+}
+
+// does the pattern match hay[0..len)? (len is the pattern's length)
+bool pattern_at(const Pattern *pat, const unsigned char *hay) {
+    if (!pat->icase) return memcmp(hay, pat->bytes, pat->len) == 0;
+    const unsigned char *f = (const unsigned char *)pat->folded;
+    for (size_t j = 0; j < pat->len; j++)
+        if (pat->fold[hay[j]] != f[j]) return false;
+    return true;
+}
+
+// Horspool search of hay[0..n) for the pattern, for -i (the shift table is on folded bytes)
+const char *pattern_horspool(const Pattern *pat, const char *hay, size_t n) {
+    const unsigned char *h = (const unsigned char *)hay;
+    size_t m = pat->len;
+    for (size_t i = 0; i + m <= n; i += pat->shift[pat->fold[h[i + m - 1]]])
+        if (pattern_at(pat, h + i)) return hay + i;
+    return NULL;
+}
+
+// first occurrence of the pattern in hay[0..n), or NULL
+const char *pattern_find(const Pattern *pat, const char *hay, size_t n) {
+    size_t m = pat->len;
+    if (m == 0) return hay;
+    if (n < m) return NULL;
+    if (!pat->scan_rare)
+        return pat->icase ? pattern_horspool(pat, hay, n) : memmem(hay, n, pat->bytes, m);
+
+    // the rare byte of a match at i is at i + rare, so only look for it in [rare, n - m + rare]
+    const char *p = hay + pat->rare;
+    const char *end = hay + (n - m) + pat->rare + 1;
+    char c = pat->folded[pat->rare];
+    size_t misses = 0;
+    while (p < end) {
+        const char *hit = pat->icase ? find_either_byte(p, (size_t)(end - p), c, pat->rare_alt)
+                                     : find_byte(p, (size_t)(end - p), c);
+        if (!hit) return NULL;
+        const char *start = hit - pat->rare;
+        if (pattern_at(pat, (const unsigned char *)start)) return start;
+        p = hit + 1;
+        // the byte isn't rare in this text: search the rest another way
+        if (++misses >= 8 && (size_t)(p - hay) <= misses * RARE_MISS_GAP) {
+            size_t from = (size_t)(start + 1 - hay);
+            return pat->icase ? pattern_horspool(pat, start + 1, n - from)
+                              : memmem(start + 1, n - from, pat->bytes, m);
+        }
+    }
+    return NULL;
+}
+
+
+// -----------------------------------------------------
+// ------------------ Matching ------------------
+// -----------------------------------------------------
+// Lines are passed as (pointer, length) without their trailing newline. They are not
+// NUL terminated, so the searches are all length-aware
+
+// a match within a line, as byte offsets [start, end)
+typedef struct {
+    size_t start;
+    size_t end;
+} MatchSpan;
+
+// regexec() on line[from..len). REG_STARTEND lets us search in place; libraries
+// without it get a NUL terminated copy of the line, in a buffer kept (and charged) for
+// the run and freed by regexec_span_free
+#ifndef REG_STARTEND
+char *regexec_copy = NULL;
+size_t regexec_copy_cap = 0;
+#endif
+
+int regexec_span(const regex_t *regex, const char *line, size_t from, size_t len,
+                 regmatch_t *m, int eflags) {
+#ifdef REG_STARTEND
+    m->rm_so = (regoff_t)from;
+    m->rm_eo = (regoff_t)len;
+    return regexec(regex, line, 1, m, eflags | REG_STARTEND);
+#else
+    if (len + 1 > regexec_copy_cap) {
+        free(regexec_copy);
+        mem_release(regexec_copy_cap);
+        regexec_copy_cap = len + 1;
+        regexec_copy = xmalloc(regexec_copy_cap);
+        mem_charge(regexec_copy_cap);
+    }
+    memcpy(regexec_copy, line, len);
+    mem.copied += len;
+    regexec_copy[len] = '\0';
+    int ret = regexec(regex, regexec_copy + from, 1, m, eflags);
+    if (ret == 0) {
+        m->rm_so += (regoff_t)from;
+        m->rm_eo += (regoff_t)from;
+    }
+    return ret;
+#endif
+}
+
+void regexec_span_free(void) {
+#ifndef REG_STARTEND
+    free(regexec_copy);
+    mem_release(regexec_copy_cap);
+    regexec_copy = NULL;
+    regexec_copy_cap = 0;
+#endif
+}
+
+// find the first match in line[from..len); fills in span (offsets from the start of line)
+bool find_match(const char *line, size_t len, size_t from, const Options *opts,
+                const regex_t *regex, MatchSpan *span) {
+// +++++++++++
+// Handle -E: 2of3: use regex
+// +++++++++++
+    if (opts->use_regex) {
+        regmatch_t m;
+        if (regexec_span(regex, line, from, len, &m, from > 0 ? REG_NOTBOL : 0) != 0) return false;
+        span->start = (size_t)m.rm_so;
+        span->end = (size_t)m.rm_eo;
+        return true;
+    }
+
+// +++++++++++
+// Handle -i: 3of3: compare case-insensitively. the pattern knows (see 1of3)
+// +++++++++++
+    const char *hit = pattern_find(opts->pattern, line + from, len - from);
+    if (!hit) return false;
+    span->start = (size_t)(hit - line);
+    span->end = span->start + opts->pattern->len;
+    return true;
+}
+
+// move span on to the next match in the line, searching from the end of the current one.
+// An empty match (e.g. regex "x*") has to move on a byte or we'd find it forever
+bool next_match(const char *line, size_t len, const Options *opts, const regex_t *regex,
+                MatchSpan *span) {
+    size_t from = span->end > span->start ? span->end : span->end + 1;
+    if (from > len) return false;
+    return find_match(line, len, from, opts, regex, span);
+}
+
+// are match positions needed (to highlight or report them), or only which lines match?
+bool spans_wanted(const Options *opts) {
+    return opts->color || opts->format != FORMAT_TEXT;
+}
+
+// does the line match? the first match span is returned in first (if not NULL, and if
+// spans_wanted) so a caller that highlights matches doesn't need to search the line again
+bool line_contains(const char *line, size_t len, const Options *opts, const regex_t *regex,
+                   MatchSpan *first) {
+    MatchSpan span;
+    bool matched;
+
+// +++++++++++
+// Handle -E: 3of3: the DFA decides whether the line matches; regexec() is only needed to find
+// where, and only on lines that do match
+// +++++++++++
+    if (opts->stream) {
+        matched = sre_line_matches(opts->stream, line, len);
+        if (matched && spans_wanted(opts)) matched = find_match(line, len, 0, opts, regex, first ? first : &span);
+    } else {
+        matched = find_match(line, len, 0, opts, regex, first ? first : &span);
+    }
+
+// +++++++++++
+// Handle -r: return lines that do NOT match
+// +++++++++++
+    return opts->reverse_find ? !matched : matched;
+}
+
+// -----------------------------------------------------
+// ------------------ Buffered Output ------------------
+// -----------------------------------------------------
+// All stdout output goes through one large append buffer which is flushed with write(2).
+// This avoids stdio locking and format parsing for every printed line.
+#define OUT_BUF_SIZE (256 * 1024)
+
+// How large blocks of unchanged input can get to stdout without being copied through
+// user space (--raw). Only Linux has the system calls for it
+typedef enum {
+    ZC_NONE,		// not possible: everything goes through the buffer
+    ZC_SPLICE,		// stdout is a pipe: splice(2) from the input file
+    ZC_COPY_RANGE,	// stdout is a regular file: copy_file_range(2)
+    ZC_SENDFILE		// stdout is a socket: sendfile(2)
+} ZeroCopy;
+
+// When buffered output is written out
+typedef enum {
+    FLUSH_FULL,		// only when the buffer is full (regular files: best throughput)
+    FLUSH_LINE,		// at the end of every line (terminals, or --line-buffered)
+    FLUSH_TIMED		// within flush_ms of being buffered (pipes, or --flush-ms)
+} FlushPolicy;
+
+#define DEFAULT_FLUSH_MS 50
+
+typedef struct {
+    int fd;					// where the buffer is flushed to
+    char *buf;				// append buffer
+    size_t len;				// bytes currently held
+    size_t cap;				// size of buf
+    FlushPolicy policy;
+    int flush_ms;			// FLUSH_TIMED: longest a line may wait in the buffer
+    long long pending_since;	// FLUSH_TIMED: when we first saw the buffered bytes (ms, 0 = not yet)
+    unsigned long pending_writes;	// out.writes at that time (if it changes, the bytes are newer)
+    unsigned long writes;	// count of writes to fd, so callers can tell if buffered bytes have gone
+    ZeroCopy zero_copy;		// how the kernel can copy input to fd for us
+} OutBuf;
+
+OutBuf out;
+
+// line_buffered and flush_ms (-1 if not set) are the command line overrides
+void out_init(int fd, bool line_buffered, int flush_ms) {
+    out = (OutBuf){0};
+    out.fd = fd;
+    out.cap = OUT_BUF_SIZE;
+    out.buf = big_alloc(&out.cap);
+    out.zero_copy = ZC_NONE;
+
+    // someone watching a terminal wants every line at once; a pipe may feed something that
+    // is waiting for us, so don't sit on lines for long; files just want throughput
+    struct stat st;
+    bool have_st = fstat(fd, &st) == 0;
+    out.policy = FLUSH_FULL;
+    out.flush_ms = DEFAULT_FLUSH_MS;
+    if (isatty(fd)) out.policy = FLUSH_LINE;
+    else if (have_st && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) out.policy = FLUSH_TIMED;
+    if (flush_ms >= 0) {
+        out.policy = FLUSH_TIMED;
+        out.flush_ms = flush_ms;
+    }
+    if (line_buffered) out.policy = FLUSH_LINE;
+
+#ifdef __linux__
+    if (have_st && !isatty(fd)) {
+        if (S_ISFIFO(st.st_mode)) out.zero_copy = ZC_SPLICE;
+        else if (S_ISREG(st.st_mode)) out.zero_copy = ZC_COPY_RANGE;
+        else if (S_ISSOCK(st.st_mode)) out.zero_copy = ZC_SENDFILE;
+    }
+#endif
+}
+
+// write n bytes straight to the output fd, retrying on partial writes and signals
+void out_write_fd(const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(out.fd, s, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        s += w;
+        n -= (size_t)w;
+    }
+    out.writes++;
+}
+
+void out_flush(void) {
+    if (out.len == 0) return;
+    out_write_fd(out.buf, out.len);
+    out.len = 0;
+}
+
+void out_write(const char *s, size_t n) {
+    if (n > out.cap - out.len) {
+        out_flush();
+        // too big to be worth buffering - send it directly
+        if (n >= out.cap) {
+            out_write_fd(s, n);
+            return;
+        }
+    }
+    memcpy(out.buf + out.len, s, n);
+    out.len += n;
+}
+
+void out_putc(char c) {
+    if (out.len == out.cap) out_flush();
+    out.buf[out.len++] = c;
+}
+
+void out_str(const char *s) {
+    out_write(s, strlen(s));
+}
+
+// make room for n bytes at the end of the buffer and return where they go; the caller
+// fills them in and then adds the number actually used to out.len
+char *out_reserve(size_t n) {
+    if (n > out.cap - out.len) out_flush();
+    return out.buf + out.len;
+}
+
+// terminate a line of output
+void out_eol(void) {
+    out_putc('\n');
+    if (out.policy == FLUSH_LINE) out_flush();
+}
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// FLUSH_TIMED: how long the buffered bytes can still wait (ms), or -1 if there's no deadline.
+// Looking at the clock for every line would cost more than it saves, so this is called
+// between blocks of input; bytes are timed from the first call that sees them
+int out_flush_timeout(void) {
+    if (out.policy != FLUSH_TIMED || out.len == 0) return -1;
+    long long now = now_ms();
+    if (out.pending_since == 0 || out.pending_writes != out.writes) {
+        out.pending_since = now;
+        out.pending_writes = out.writes;
+    }
+    long long left = out.pending_since + out.flush_ms - now;
+    return left > 0 ? (int)left : 0;
+}
+
+// called before reading more input: flush anything that is due, and if the read could
+// block (pipes, terminals) wait no longer than the deadline before flushing
+void out_before_read(int in_fd, bool may_block) {
+    int timeout = out_flush_timeout();
+    if (timeout < 0) return;
+    if (timeout > 0 && may_block) {
+        struct pollfd p = {in_fd, POLLIN, 0};
+        if (poll(&p, 1, timeout) > 0) return;	// input is ready - carry on
+    } else if (timeout > 0) {
+        return;
+    }
+    out_flush();
+}
+
+// -----------------------------------------------------
+// ------------------ Zero-copy Output ------------------
+// -----------------------------------------------------
+// With --raw and no prefixes or cropping, output lines are the input bytes unchanged.
+// A big enough run of them can be sent from the input file to stdout by the kernel
+// (splice / copy_file_range / sendfile), never passing through our buffer
+#define ZERO_COPY_MIN (64 * 1024)	// smaller runs are cheaper to copy through the buffer
+
+// copy [off, off + n) of in_fd into the output buffer with pread (the fallback)
+void out_copy_from_fd(int in_fd, off_t off, size_t n) {
+    while (n > 0) {
+        size_t chunk = n < out.cap ? n : out.cap;
+        char *p = out_reserve(chunk);
+        ssize_t r = pread(in_fd, p, chunk, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (r < 0) perror("read");
+            return;
+        }
+        out.len += (size_t)r;
+        off += r;
+        n -= (size_t)r;
+    }
+}
+
+// have the kernel send [off, off + n) of in_fd to the output. Returns how many bytes went;
+// if it's short of n the kernel can't do it for these files and the rest must be copied
+size_t out_kernel_copy(int in_fd, off_t off, size_t n) {
+    size_t done = 0;
+#ifdef __linux__
+    out_flush();	// everything already buffered has to go first
+    while (done < n && out.zero_copy != ZC_NONE) {
+        off_t pos = off + (off_t)done;
+        ssize_t w;
+        if (out.zero_copy == ZC_SPLICE) w = splice(in_fd, &pos, out.fd, NULL, n - done, SPLICE_F_MOVE);
+        else if (out.zero_copy == ZC_COPY_RANGE) w = copy_file_range(in_fd, &pos, out.fd, NULL, n - done, 0);
+        else w = sendfile(out.fd, in_fd, &pos, n - done);
+
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            // copy_file_range refuses some pairs of files (e.g. across filesystems on older
+            // kernels, or O_APPEND output) where sendfile still works. Otherwise give up on it
+            out.zero_copy = (w < 0 && out.zero_copy == ZC_COPY_RANGE) ? ZC_SENDFILE : ZC_NONE;
+            continue;
+        }
+        done += (size_t)w;
+    }
+    out.writes++;
+#else
+    UNUSED(in_fd);
+    UNUSED(off);
+    UNUSED(n);
+#endif
+    return done;
+}
+
+// -----------------------------------------------------
+// ------------------ Number Formatting ------------------
+// -----------------------------------------------------
+// Line numbers and counts are converted two digits at a time from a lookup table,
+// so no printf-family call is made on the per-line output path
+#define UINT_MAX_DIGITS 20	// digits in the largest unsigned long (64 bit)
+
+const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+int uint_digits(unsigned long v) {
+    int n = 1;
+    for (;;) {
+        if (v < 10) return n;
+        if (v < 100) return n + 1;
+        if (v < 1000) return n + 2;
+        if (v < 10000) return n + 3;
+        v /= 10000;
+        n += 4;
+    }
+}
+
+// write v into dst zero padded to at least min_width digits (i.e. "%0*lu"), no terminator.
+// dst needs room for max(min_width, UINT_MAX_DIGITS) chars. Returns the number of chars written
+size_t fmt_uint(char *dst, unsigned long v, int min_width) {
+    int digits = uint_digits(v);
+    int width = digits > min_width ? digits : min_width;
+    char *p = dst + width;
+
+    while (v >= 100) {
+        const char *pair = digit_pairs + (v % 100) * 2;
+        v /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (v >= 10) {
+        *--p = digit_pairs[v * 2 + 1];
+        *--p = digit_pairs[v * 2];
+    } else {
+        *--p = (char)('0' + v);
+    }
+    while (p > dst) *--p = '0';
+    return (size_t)width;
+}
+
+// format a number straight into the output buffer
+void out_uint(unsigned long v, int min_width) {
+    if (min_width > UINT_MAX_DIGITS) min_width = UINT_MAX_DIGITS;
+    char *p = out_reserve(UINT_MAX_DIGITS);
+    out.len += fmt_uint(p, v, min_width);
+}
+
+// -----------------------------------------------------
+// ------------------ Helper for stripping filename ---------
+// -----------------------------------------------------
+const char *get_basename(const char *path){
+    if (path == NULL) return NULL;
+
+    const char *last = strrchr(path, '/');
+    if (last) return last + 1;  // character after last '/'
+    return path;    	      	// no slash, whole string is filename
+}
+
+// -----------------------------------------------------
+// ------------------ Line prefix ---------
+// -----------------------------------------------------
+// The prefix printed in front of each line. The -f part is the same for every line
+// of a file, so it is rendered once when the file is opened; only the -n number
+// is formatted per line
+typedef struct {
+    char *file;			// "basename:" or NULL if -f not specified
+    size_t file_len;
+    bool line_numbers;	// -n
+} LinePrefix;
+
+void prefix_init(LinePrefix *pre, const char *filename, bool show_fname, bool show_line_nums) {
+    *pre = (LinePrefix){0};
+    pre->line_numbers = show_line_nums;
+    if (show_fname) {
+        const char *base = get_basename(filename);
+        size_t n = strlen(base);
+        pre->file = xmalloc(n + 1);
+        memcpy(pre->file, base, n);
+        pre->file[n] = ':';
+        pre->file_len = n + 1;
+    }
+}
+
+void prefix_free(LinePrefix *pre) {
+    free(pre->file);
+    pre->file = NULL;
+}
+
+void out_prefix(const LinePrefix *pre, int lineno) {
+// +++++++++++
+// Handle -f: Print with optional file name prefix
+// +++++++++++
+    if (pre->file_len) out_write(pre->file, pre->file_len);
+
+// +++++++++++
+// Handle -n: Print with optional line numbers prefix (i.e. "%04d:")
+// +++++++++++
+    if (pre->line_numbers) {
+        char *p = out_reserve(UINT_MAX_DIGITS + 1);
+        size_t n = fmt_uint(p, (unsigned long)lineno, 4);
+        p[n] = ':';
+        out.len += n + 1;
+    }
+}
+
+// -----------------------------------------------------
+// ------------------ Helper for Line Printing ---------
+// -----------------------------------------------------
+#define COLOR_MATCH "\033[01;31m"	// bold red, as grep uses
+#define COLOR_RESET "\033[m"
+
+// The part of a line that is printed, in display columns [first_col, end_col)
+// (set by -L and -l), and the display column reached so far
+typedef struct {
+    size_t first_col;
+    size_t end_col;
+    size_t col;
+    bool raw;		// --raw: a tab is a byte like any other, one column wide
+} LineWindow;
+
+// +++++++++++
+// Handle -L and -l: print the window of display columns [line_crop, line_crop + line_limit),
+// or everything from line_crop on if there is no -l
+// +++++++++++
+void window_init(LineWindow *w, const Options *opts) {
+    *w = (LineWindow){0};
+    w->first_col = opts->line_crop > 0 ? (size_t)opts->line_crop : 0;
+    w->end_col = opts->line_limit >= 0 ? w->first_col + (size_t)opts->line_limit : SIZE_MAX;
+    w->raw = opts->raw;
+}
+
+// Print p[0..n), the next piece of a line, clipped to the window and expanding each tab to
+// the next tab stop (unless --raw). Runs of ordinary bytes are skipped or copied whole, so the work done is
+// proportional to the tabs and the visible window, not the full line. If open is not NULL it
+// is written just before the first visible byte (to start a highlight). Returns true if any
+// of the piece was visible
+bool out_window_piece(LineWindow *w, const char *p, size_t n, const char *open) {
+    static const char spaces[] = "                ";	// at least TAB_WIDTH spaces
+    const char *end = p + n;
+    bool visible = false;
+
+    while (w->col < w->end_col) {
+        const char *tab = w->raw ? NULL : find_byte(p, (size_t)(end - p), '\t');
+
+        // ordinary bytes up to the next tab occupy columns [col, col + run)
+        size_t run = (size_t)((tab ? tab : end) - p);
+        if (w->col + run > w->first_col && run > 0) {
+            size_t from = w->col < w->first_col ? w->first_col - w->col : 0;
+            size_t to = w->col + run < w->end_col ? run : w->end_col - w->col;
+            if (open && !visible) out_str(open);
+            visible = true;
+            out_write(p + from, to - from);
+        }
+        w->col += run;
+        if (!tab) break;
+
+        // the tab occupies columns [col, next tab stop)
+        size_t stop = w->col + TAB_WIDTH - (w->col % TAB_WIDTH);
+        size_t lo = w->col > w->first_col ? w->col : w->first_col;
+        size_t hi = stop < w->end_col ? stop : w->end_col;
+        if (hi > lo) {
+            if (open && !visible) out_str(open);
+            visible = true;
+            out_write(spaces, hi - lo);
+        }
+        w->col = stop;
+        p = tab + 1;
+    }
+    return visible;
+}
+
+// +++++++++++
+// Handle --color: 2of3: print the line with every match highlighted. The first match was
+// found when the line was tested, so searching carries on from the end of it
+// +++++++++++
+void out_highlighted(LineWindow *w, const char *line, size_t len, const Options *opts,
+                     const regex_t *regex, const MatchSpan *first) {
+    MatchSpan span = *first;
+    size_t pos = 0;		// start of the bytes not yet printed
+
+    for (;;) {
+        out_window_piece(w, line + pos, span.start - pos, NULL);
+        if (w->col >= w->end_col) return;
+        if (span.end > span.start) {
+            if (out_window_piece(w, line + span.start, span.end - span.start, COLOR_MATCH))
+                out_str(COLOR_RESET);
+        }
+        pos = span.end;
+        if (!next_match(line, len, opts, regex, &span)) break;
+    }
+    out_window_piece(w, line + pos, len - pos, NULL);
+}
+
+// print one line with its prefix. first is the line's first match span if matches are to
+// be highlighted, or NULL
+void print_line(const LinePrefix *pre, const char *line, size_t len, int lineno,
+                const Options *opts, const regex_t *regex, const MatchSpan *first)
+{
+    // Strip trailing newline if present - we don't want to duplicate this later
+    if (len > 0 && line[len-1] == '\n') len--;
+
+    out_prefix(pre, lineno);
+
+    LineWindow w;
+    window_init(&w, opts);
+
+    // Lines without tabs (the usual case, or any line with --raw) are printed straight from
+    // the input buffer. Lines with tabs have only the visible window expanded, directly into
+    // the output
+    if (first) {
+        out_highlighted(&w, line, len, opts, regex, first);
+    } else if (opts->raw || find_byte(line, len, '\t') == NULL) {
+        if (len > w.first_col) out_write(line + w.first_col, (len < w.end_col ? len : w.end_col) - w.first_col);
+    } else {
+        out_window_piece(&w, line, len, NULL);
+    }
+    out_eol();
+}
+
+
+// -----------------------------------------------------
+// ------------------ JSON Lines Output ------------------
+// -----------------------------------------------------
+// --json writes one object per output line, straight into the output buffer (no
+// allocation). Line text is escaped as a JSON string. UTF-8 is passed through as it is,
+// but JSON can't hold bytes that aren't UTF-8: they're written as U+FFFD, and the line's
+// bytes as they are in the file go in a "bytes" field as well, in base64
+
+// how many bytes at the start of p[0..n) can go into a JSON string unescaped (ASCII,
+// but not '"', '\\' or control characters). 16 bytes per step with SSE2 / NEON
+size_t json_plain_run(const char *p, size_t n) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctl = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, quote), _mm_cmpeq_epi8(block, bslash)),
+                                   _mm_cmpeq_epi8(_mm_min_epu8(block, ctl), block));	// block <= 0x1F
+        int mask = _mm_movemask_epi8(hit) | _mm_movemask_epi8(block);	// or >= 0x80
+        if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t bslash = vdupq_n_u8('\\');
+    const uint8x16_t ctl = vdupq_n_u8(0x1F);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t block = vld1q_u8((const uint8_t *)(p + i));
+        uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(block, quote), vceqq_u8(block, bslash)),
+                                  vorrq_u8(vcleq_u8(block, ctl), vcgeq_u8(block, vdupq_n_u8(0x80))));
+        if (vmaxvq_u8(hit)) break;	// it's in this block - the loop below finds exactly where
+    }
+#endif
+    for (; i < n; i++) {
+        unsigned char c = (unsigned char)p[i];
+        if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\') break;
+    }
+    return i;
+}
+
+// the length of the UTF-8 character at s[0..n) (not ASCII): 2 to 4, 0 if it isn't one, or
+// -1 if it could be but n cuts it off
+int utf8_char(const unsigned char *s, size_t n) {
+    unsigned char c = s[0];
+    int len;
+    unsigned char lo = 0x80, hi = 0xBF;		// range of the second byte
+    if (c >= 0xC2 && c <= 0xDF) len = 2;
+    else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        if (c == 0xE0) lo = 0xA0;			// no overlong forms
+        if (c == 0xED) hi = 0x9F;			// no surrogates
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        if (c == 0xF0) lo = 0x90;
+        if (c == 0xF4) hi = 0x8F;			// nothing past U+10FFFF
+    } else {
+        return 0;
+    }
+    for (int i = 1; i < len; i++) {
+        if ((size_t)i >= n) return -1;
+        unsigned char b = s[i];
+        if (i == 1 ? b < lo || b > hi : (b & 0xC0) != 0x80) return 0;
+    }
+    return len;
+}
+
+// the characters of a JSON string, escaped (the caller writes the quotes, so a long line
+// can be written a piece at a time). Bytes that aren't UTF-8 are written as U+FFFD and set
+// *invalid. If more, s is just a piece of the string: a character cut off at the end of it
+// is left for the next piece. Returns how many bytes were written
+size_t out_json_chars(const char *s, size_t n, bool more, bool *invalid) {
+    static const char hex[] = "0123456789abcdef";
+    const char *start = s;
+    for (;;) {
+        size_t run = json_plain_run(s, n);
+        out_write(s, run);
+        s += run;
+        n -= run;
+        if (n == 0) break;
+
+        unsigned char c = (unsigned char)*s;
+        if (c >= 0x80) {
+            int len = utf8_char((const unsigned char *)s, n);
+            if (len < 0 && more) break;
+            if (len > 0) {
+                out_write(s, (size_t)len);
+            } else {
+                out_write("\\ufffd", 6);
+                *invalid = true;
+                len = 1;
+            }
+            s += len;
+            n -= (size_t)len;
+            continue;
+        }
+        s++;
+        n--;
+        switch (c) {
+            case '"':  out_write("\\\"", 2); break;
+            case '\\': out_write("\\\\", 2); break;
+            case '\n': out_write("\\n", 2); break;
+            case '\r': out_write("\\r", 2); break;
+            case '\t': out_write("\\t", 2); break;
+            case '\b': out_write("\\b", 2); break;
+            case '\f': out_write("\\f", 2); break;
+            default: {
+                char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+                out_write(esc, sizeof(esc));
+            }
+        }
+    }
+    return (size_t)(s - start);
+}
+
+// s[0..n) as a JSON string. Returns whether it had bytes that aren't UTF-8
+bool out_json_string(const char *s, size_t n) {
+    bool invalid = false;
+    out_putc('"');
+    out_json_chars(s, n, false, &invalid);
+    out_putc('"');
+    return invalid;
+}
+
+// p[0..n) in base64. Only the last piece of a longer run of bytes may have a length that
+// isn't a multiple of 3
+void out_base64(const unsigned char *p, size_t n) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (; n >= 3; p += 3, n -= 3) {
+        char quad[4] = {digits[p[0] >> 2], digits[(p[0] & 3) << 4 | p[1] >> 4],
+                        digits[(p[1] & 0xF) << 2 | p[2] >> 6], digits[p[2] & 0x3F]};
+        out_write(quad, 4);
+    }
+    if (n > 0) {
+        unsigned char b1 = n > 1 ? p[1] : 0;
+        char quad[4] = {digits[p[0] >> 2], digits[(p[0] & 3) << 4 | b1 >> 4],
+                        n > 1 ? digits[(b1 & 0xF) << 2] : '=', '='};
+        out_write(quad, 4);
+    }
+}
+
+// why a line is being output
+typedef enum {
+    LINE_MATCH,		// it matched (or didn't, with -r)
+    LINE_BEFORE,	// -b context
+    LINE_AFTER		// -a context
+} LineKind;
+
+// {"type":"match","path":"src/a.c","line":12,"offset":345,"text":"...","spans":[[4,9]]}
+// offset is the byte offset of the line in the file, spans are byte offsets within the
+// line as it is in the file. A line that isn't UTF-8 has those bytes in "bytes" (base64)
+// after "text". Context lines have type "before" or "after" and no spans. first is the
+// first match span of a match line (NULL with -r, where match lines have no matches)
+// everything up to the line text: {"type":...,"offset":345,"text":
+void out_json_line_start(const char *filename, int lineno, off_t offset, LineKind kind) {
+    static const char *kind_names[] = {"match", "before", "after"};
+
+    out_str("{\"type\":\"");
+    out_str(kind_names[kind]);
+    out_str("\",\"path\":");
+    out_json_string(filename, strlen(filename));
+    out_str(",\"line\":");
+    out_uint((unsigned long)lineno, 0);
+    out_str(",\"offset\":");
+    out_uint((unsigned long)offset, 0);
+    out_str(",\"text\":");
+}
+
+// one [start,end] pair of the spans list
+void out_json_span(const MatchSpan *span, bool comma) {
+    if (comma) out_putc(',');
+    out_putc('[');
+    out_uint((unsigned long)span->start, 0);
+    out_putc(',');
+    out_uint((unsigned long)span->end, 0);
+    out_putc(']');
+}
+
+void out_json_line(const char *filename, const char *line, size_t len, int lineno, off_t offset,
+                   LineKind kind, const Options *opts, const regex_t *regex, const MatchSpan *first) {
+    if (len > 0 && line[len-1] == '\n') len--;
+    out_json_line_start(filename, lineno, offset, kind);
+    if (out_json_string(line, len)) {
+        out_str(",\"bytes\":\"");
+        out_base64((const unsigned char *)line, len);
+        out_putc('"');
+    }
+    if (kind == LINE_MATCH) {
+        out_str(",\"spans\":[");
+        if (first) {
+            MatchSpan span = *first;
+            bool more = true;
+            for (bool comma = false; more; comma = true) {
+                out_json_span(&span, comma);
+                more = next_match(line, len, opts, regex, &span);
+            }
+        }
+        out_putc(']');
+    }
+    out_putc('}');
+    out_eol();
+}
+
+// {"type":"file","path":"src/a.c"} for -m, {"type":"count","path":"src/a.c","count":3} for -c
+void out_json_file(const char *type, const char *filename, const int *count) {
+    out_str("{\"type\":\"");
+    out_str(type);
+    out_str("\",\"path\":");
+    out_json_string(filename, strlen(filename));
+    if (count) {
+        out_str(",\"count\":");
+        out_uint((unsigned long)*count, 0);
+    }
+    out_putc('}');
+    out_eol();
+}
+
+
+// -----------------------------------------------------
+// ------------------ Binary Output ------------------
+// -----------------------------------------------------
+// --format=binary writes the length-prefixed records described in ggrep_binary.h.
+// Numbers are stored little endian whatever the host byte order
+
+void put_u16(char *p, unsigned v) {
+    p[0] = (char)(v & 0xFF);
+    p[1] = (char)((v >> 8) & 0xFF);
+}
+
+void put_u32(char *p, unsigned long v) {
+    for (int i = 0; i < 4; i++) p[i] = (char)((v >> (8 * i)) & 0xFF);
+}
+
+void put_u64(char *p, unsigned long long v) {
+    for (int i = 0; i < 8; i++) p[i] = (char)((v >> (8 * i)) & 0xFF);
+}
+
+void out_u32(unsigned long v) {
+    char *p = out_reserve(4);
+    put_u32(p, v);
+    out.len += 4;
+}
+
+void out_u64(unsigned long long v) {
+    char *p = out_reserve(8);
+    put_u64(p, v);
+    out.len += 8;
+}
+
+// record length field and type byte
+void out_bin_record(size_t payload_len, int type) {
+    char *p = out_reserve(9);
+    put_u64(p, (unsigned long long)payload_len + 1);
+    p[8] = (char)type;
+    out.len += 9;
+}
+
+void out_bin_header(const Options *opts) {
+    char *p = out_reserve(GGRB_HEADER_LEN);
+    memcpy(p, GGRB_MAGIC, 4);
+    put_u16(p + 4, GGRB_VERSION);
+    put_u16(p + 6, opts->with_lines ? GGRB_FLAG_LINES : 0);
+    out.len += GGRB_HEADER_LEN;
+}
+
+void out_bin_file(unsigned file_id, const char *filename) {
+    size_t n = strlen(filename);
+    out_bin_record(4 + 4 + n, GGRB_REC_FILE);
+    out_u32(file_id);
+    out_u32((unsigned long)n);
+    out_write(filename, n);
+}
+
+// a GGRB_REC_LINE record up to its spans, which the caller writes next (then the text if
+// --with-lines). len is the length of the line without its newline
+void out_bin_line_start(unsigned file_id, size_t len, int lineno, off_t offset, LineKind kind,
+                        const Options *opts, size_t nspans) {
+    size_t payload = 4 + 1 + 8 + 8 + 8 + nspans * 16 + (opts->with_lines ? 8 + len : 0);
+    out_bin_record(payload, GGRB_REC_LINE);
+    out_u32(file_id);
+    out_putc((char)(kind == LINE_MATCH ? GGRB_KIND_MATCH : kind == LINE_BEFORE ? GGRB_KIND_BEFORE : GGRB_KIND_AFTER));
+    out_u64((unsigned long long)lineno);
+    out_u64((unsigned long long)offset);
+    out_u64((unsigned long long)nspans);
+}
+
+void out_bin_line(unsigned file_id, const char *line, size_t len, int lineno, off_t offset,
+                  LineKind kind, const Options *opts, const regex_t *regex, const MatchSpan *first) {
+    // the record length comes first, so collect the spans before writing anything.
+    // The list is kept between calls and only grows, so this doesn't allocate per line.
+    // If it can't grow within --max-memory the spans are just counted, and found again
+    static MatchSpan *spans = NULL;
+    static size_t spans_cap = 0;
+    size_t nspans = 0;
+    bool listed = true;		// all the spans are in the list
+
+    if (len > 0 && line[len-1] == '\n') len--;
+    if (first) {
+        MatchSpan span = *first;
+        do {
+            if (nspans == spans_cap && listed) {
+                size_t cap = spans_cap ? spans_cap * 2 : 16;
+                if (mem_fits((cap - spans_cap) * sizeof(MatchSpan))) {
+                    mem_charge((cap - spans_cap) * sizeof(MatchSpan));
+                    spans_cap = cap;
+                    spans = xrealloc(spans, spans_cap * sizeof(MatchSpan));
+                } else {
+                    listed = false;
+                }
+            }
+            if (listed) spans[nspans] = span;
+            nspans++;
+        } while (next_match(line, len, opts, regex, &span));
+    }
+
+    out_bin_line_start(file_id, len, lineno, offset, kind, opts, nspans);
+    if (listed) {
+        for (size_t i = 0; i < nspans; i++) {
+            out_u64((unsigned long long)spans[i].start);
+            out_u64((unsigned long long)spans[i].end);
+        }
+    } else {
+        MatchSpan span = *first;
+        do {
+            out_u64((unsigned long long)span.start);
+            out_u64((unsigned long long)span.end);
+        } while (next_match(line, len, opts, regex, &span));
+    }
+    if (opts->with_lines) {
+        out_u64((unsigned long long)len);
+        out_write(line, len);
+    }
+}
+
+void out_bin_count(unsigned file_id, int count) {
+    out_bin_record(4 + 8, GGRB_REC_COUNT);
+    out_u32(file_id);
+    out_u64((unsigned long long)count);
+}
+
+void out_bin_matched_file(unsigned file_id) {
+    out_bin_record(4, GGRB_REC_MATCHED_FILE);
+    out_u32(file_id);
+}
+
+
+// -----------------------------------------------------
+// ------------------ Line Reader ------------------
+// -----------------------------------------------------
+// Input is read in large blocks with read(2) and handed out a line at a time as views
+// into the block. A line that runs past the end of the block is moved to the front
+// before the next read (and the buffer grows if a single line fills it). The caller can
+// also pin earlier lines (the -b window) so they are kept in the buffer across reads.
+// If the caller allows it (split_long), a line of LONG_LINE_MIN bytes or more that fills the
+// buffer is handed out in pieces instead, so the buffer doesn't have to grow to hold it.
+//
+// Pipes (and other input that can't be read again) get a ring buffer instead where the
+// system allows it: the same pages mapped twice, one copy straight after the other. Bytes
+// read past the end of the first copy appear at the start of it too, so dropping the lines
+// already done just moves buf along the ring; nothing is copied, and a line that wraps
+// round the end is still one run of memory
+#define READ_BLOCK_SIZE (256 * 1024)
+#define LONG_LINE_MIN (READ_BLOCK_SIZE / 2)
+
+typedef struct {
+    int fd;
+    const char *name;	// for error messages
+    bool seekable;		// a regular file: earlier lines can be read again with pread
+    bool may_block;		// not a regular file: a read may have to wait for the writer
+    char *ring;			// if not NULL, buf is a window into this ring of cap bytes (mapped twice)
+    char *buf;
+    size_t cap;
+    size_t pos;			// start of the next line
+    size_t scanned;		// buf[pos..scanned) is known to have no newline
+    size_t end;			// end of the data read so far
+    off_t buf_offset;	// offset in the input of buf[0]
+    off_t keep_from;	// input from this offset on must stay in the buffer (-1: only from pos)
+    bool eof;
+    bool split_long;	// hand out long lines in pieces
+    bool can_split;		// the pieces can still be searched: split over --max-memory, not grow
+    size_t overlap;		// each piece after the first repeats this many bytes from the end of the last
+    bool partial;		// the view last handed out is a piece of a line, and more of it follows
+} LineReader;
+
+// size bytes of memory mapped twice, back to back, or NULL if that can't be done here
+// (size must be a whole number of pages)
+char *ring_alloc(size_t size) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0 || size % (size_t)page != 0) return NULL;
+    int fd = memfd_create("ggrep-ring", MFD_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    // reserve room for both copies, then map the memfd over each half
+    char *ring = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0)
+        ring = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring != MAP_FAILED &&
+        (mmap(ring, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+         mmap(ring + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        munmap(ring, 2 * size);
+        ring = MAP_FAILED;
+    }
+    close(fd);	// the mappings keep the memory
+    if (ring == MAP_FAILED) return NULL;
+    mem_charge(size);
+    mem.allocs++;
+    return ring;
+#else
+    UNUSED(size);
+    return NULL;
+#endif
+}
+
+void ring_free(char *ring, size_t size) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    munmap(ring, 2 * size);
+    mem_release(size);
+#else
+    UNUSED(ring);
+    UNUSED(size);
+#endif
+}
+
+void reader_init(LineReader *r, int fd, const char *name) {
+    struct stat st;
+    *r = (LineReader){0};
+    r->fd = fd;
+    r->name = name;
+    r->seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    r->may_block = !r->seekable;
+    r->keep_from = -1;
+    r->cap = READ_BLOCK_SIZE;
+    if (!r->seekable) r->ring = ring_alloc(r->cap);
+    r->buf = r->ring ? r->ring : big_alloc(&r->cap);
+}
+
+void reader_free(LineReader *r) {
+    if (r->ring) ring_free(r->ring, r->cap);
+    else big_free(r->buf, r->cap);
+    r->buf = r->ring = NULL;
+}
+
+// the memory doubling the buffer takes on top of what it has: the whole new buffer while
+// the data is copied to it, unless realloc() can grow the old one
+size_t reader_grow_cost(const LineReader *r) {
+    return r->ring || huge_pages != HUGE_OFF ? 2 * r->cap : r->cap;
+}
+
+// the buffer is full: double it, keeping the data in buf[0..end). Lines that can be are
+// split before it gets here, so over --max-memory there's no going on
+void reader_grow(LineReader *r) {
+    size_t cap = r->cap * 2;
+    if (!mem_fits(reader_grow_cost(r))) {
+        out_flush();
+        fprintf(stderr, "%s: a line is too long to search within --max-memory\n", r->name);
+        exit(EXIT_FAILURE);
+    }
+    if (!r->ring) {
+        r->buf = big_realloc(r->buf, r->end, r->cap, &cap);
+    } else {
+        // a ring can't be resized in place: move to a bigger one (or a plain buffer)
+        char *ring = ring_alloc(cap);
+        char *buf = ring ? ring : big_alloc(&cap);
+        memcpy(buf, r->buf, r->end);
+        mem.copied += r->end;
+        ring_free(r->ring, r->cap);
+        r->ring = ring;
+        r->buf = buf;
+    }
+    r->cap = cap;
+}
+
+// move the partial line (and anything pinned before it) to the front of the buffer (or move
+// the front of the buffer to it, in a ring) and read some more after it
+void reader_fill(LineReader *r) {
+    // --max-memory: -b lines pinned in a full buffer that can't grow are let go (a match
+    // reads them from the file again, if it can, and counts them in mem.lost if it can't)
+    if (r->end == r->cap && r->keep_from >= 0 && !mem_fits(reader_grow_cost(r))) r->keep_from = -1;
+
+    size_t drop = r->pos;
+    if (r->keep_from >= r->buf_offset && (size_t)(r->keep_from - r->buf_offset) < drop)
+        drop = (size_t)(r->keep_from - r->buf_offset);
+    if (drop > 0) {
+        if (r->ring) r->buf = r->ring + ((size_t)(r->buf - r->ring) + drop) % r->cap;
+        else {
+            memmove(r->buf, r->buf + drop, r->end - drop);
+            mem.copied += r->end - drop;
+        }
+        r->buf_offset += (off_t)drop;
+        r->end -= drop;
+        r->scanned -= drop;
+        r->pos -= drop;
+    }
+    // one line (or the pinned lines) fills the whole buffer
+    if (r->end == r->cap) reader_grow(r);
+
+    // lines found so far shouldn't sit in the output buffer while we wait for more input
+    out_before_read(r->fd, r->may_block);
+
+    for (;;) {
+        ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) perror(r->name);
+        if (n <= 0) r->eof = true;
+        else r->end += (size_t)n;
+        if (n > 0) mem.input += (unsigned long long)n;
+        return;
+    }
+}
+
+// next line (including its newline, if it has one) as a view into the reader's buffer,
+// valid until the next call. offset is where the line starts in the input. Returns false
+// at the end of the input. If r->partial is set on return, the view is only a piece of
+// the line and the following calls return the rest of it, the last piece with partial clear
+bool reader_next_line(LineReader *r, const char **line, size_t *len, off_t *offset) {
+    r->partial = false;
+    for (;;) {
+        if (r->scanned < r->pos) r->scanned = r->pos;
+        if (r->scanned > r->end) r->scanned = r->end;
+        const char *nl = memchr(r->buf + r->scanned, '\n', r->end - r->scanned);
+        if (nl || (r->eof && r->pos < r->end)) {
+            size_t line_end = nl ? (size_t)(nl - r->buf) + 1 : r->end;
+            *line = r->buf + r->pos;
+            *len = line_end - r->pos;
+            *offset = r->buf_offset + (off_t)r->pos;
+            r->pos = line_end;
+            return true;
+        }
+        if (r->eof) return false;
+        r->scanned = r->end;
+
+        // a long line fills the buffer: hand out what we have, keeping the overlap for the
+        // next piece, rather than growing the buffer. Over --max-memory that has to be done
+        // even if the caller would rather have the whole line
+        size_t have = r->end - r->pos;
+        bool split = r->split_long || (r->can_split && !mem_fits(reader_grow_cost(r)));
+        if (split && r->end == r->cap && have >= LONG_LINE_MIN && have > r->overlap) {
+            *line = r->buf + r->pos;
+            *len = have;
+            *offset = r->buf_offset + (off_t)r->pos;
+            r->pos = r->end - r->overlap;
+            r->partial = true;
+            return true;
+        }
+        reader_fill(r);
+    }
+}
+
+// a line earlier in the input. It is a view into the buffer if it is still there (pinned
+// with keep_from); otherwise it is read again into *scratch (seekable input only, see
+// CONTEXT_PIN_MAX). Returns NULL if it can't be had
+const char *reader_view(const LineReader *r, off_t offset, size_t len, char **scratch, size_t *scratch_cap) {
+    if (offset >= r->buf_offset) return r->buf + (offset - r->buf_offset);
+    if (!r->seekable) return NULL;
+
+    if (len > *scratch_cap) {
+        free(*scratch);
+        mem_release(*scratch_cap);
+        *scratch_cap = len;
+        *scratch = xmalloc(len);
+        mem_charge(len);
+    }
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(r->fd, *scratch + got, len - got, offset + (off_t)got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) perror(r->name);
+            return NULL;
+        }
+        got += (size_t)n;
+    }
+    mem.copied += got;
+    return *scratch;
+}
+
+
+// -----------------------------------------------------
+// ------------------ Long Lines ------------------
+// -----------------------------------------------------
+// A line too long for the reader's buffer isn't held in memory. It is searched a piece at
+// a time as it is read (scan_long_line), and if it is output it is read back from the file
+// a chunk at a time, so the memory used is the same however long the line is. This is done
+// for files, or for any input when only -c / -m results are wanted (see long_lines_allowed)
+#define LONG_CHUNK READ_BLOCK_SIZE
+
+// the smallest --max-memory: the output buffer, one block of input and the long line chunks
+#define MEM_MIN (OUT_BUF_SIZE + READ_BLOCK_SIZE + 2 * LONG_CHUNK)
+
+// a long line being output
+typedef struct {
+    int fd;
+    off_t offset;		// where the line starts in the file
+    size_t len;			// its length, without the newline
+    bool has_newline;
+    char *text;			// chunk being printed
+    char *window;		// chunk being searched for matches: line bytes [win_start, win_start + win_len)
+    size_t win_start;
+    size_t win_len;
+} LongLine;
+
+// can scan_long_line search a line piece by piece at all? (-E needs the DFA)
+bool long_lines_searchable(const Options *opts) {
+    if (opts->use_regex) return opts->stream != NULL;
+    return opts->pattern->len < LONG_CHUNK;
+}
+
+// can long lines be handed out in pieces? A literal pattern is found across the join of two
+// pieces because they overlap by pattern_len - 1 bytes; -E needs the DFA, which carries its
+// state from one piece to the next, but can't say where matches are, so not if spans are
+// wanted. Lines that are output have to be read again from the file, so from a pipe a line
+// that will be printed still needs the whole of it in memory: it is only split when
+// --max-memory leaves no choice, and then it can't be printed (see mem.lost)
+bool long_lines_allowed(const LineReader *r, const Options *opts) {
+    bool output = !opts->count_only && !opts->filename_only;
+    if (!long_lines_searchable(opts)) return false;
+    if (opts->use_regex && output && spans_wanted(opts)) return false;
+    return r->seekable || !output;
+}
+
+// the reader has just handed out the first piece of a line too long to keep. Read the rest
+// of it, searching each piece: the overlap between pieces means a literal match that crosses
+// from one to the next is still found, and -E feeds the pieces through the DFA one after
+// another. first is the first match, from the start of the line (not set for -E). Returns
+// whether the line matches, like line_contains, and its full length in *len
+bool scan_long_line(LineReader *r, const char *piece, size_t n, off_t offset, size_t *len,
+                    const Options *opts, const regex_t *regex, MatchSpan *first) {
+    off_t line_start = offset;
+    off_t line_end = offset;
+    bool found = false;
+    int state = 0;		// -E: DFA state
+
+    for (;;) {
+        bool last = !r->partial;
+        line_end = offset + (off_t)n;
+        size_t text_len = n;
+        if (last && text_len > 0 && piece[text_len - 1] == '\n') text_len--;
+        if (found) {
+            // just reading to the end of the line
+        } else if (opts->stream) {
+            found = sre_feed(opts->stream, &state, piece, text_len);
+        } else if (find_match(piece, text_len, 0, opts, regex, first)) {
+            found = true;
+            first->start += (size_t)(offset - line_start);
+            first->end += (size_t)(offset - line_start);
+        }
+        if (last || !reader_next_line(r, &piece, &n, &offset)) break;
+    }
+    *len = (size_t)(line_end - line_start);
+    if (!found && opts->stream) found = sre_end(opts->stream, state, *len);
+
+// +++++++++++
+// Handle -r: long lines too
+// +++++++++++
+    return opts->reverse_find ? !found : found;
+}
+
+// read line bytes [pos, pos + n) into dst. Returns how many were read (fewer at the end
+// of the file, or on an error)
+size_t long_line_read(const LongLine *ll, char *dst, size_t pos, size_t n) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t k = pread(ll->fd, dst + got, n - got, ll->offset + (off_t)(pos + got));
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) {
+            if (k < 0) perror("read");
+            break;
+        }
+        got += (size_t)k;
+    }
+    mem.copied += got;
+    return got;
+}
+
+// set up to output the line at offset, len bytes long with its newline. The chunk buffers
+// are allocated the first time and kept for later long lines. Fails if the input can't be
+// read again (fd < 0: a pipe)
+bool long_line_open(LongLine *ll, off_t offset, size_t len) {
+    if (ll->fd < 0) return false;
+    if (!ll->text) {
+        ll->text = xmalloc(LONG_CHUNK);
+        ll->window = xmalloc(LONG_CHUNK);
+        mem_charge(2 * LONG_CHUNK);
+    }
+    ll->offset = offset;
+    ll->len = len;
+    ll->win_start = 0;
+    ll->win_len = 0;
+    char last;
+    if (len == 0 || long_line_read(ll, &last, len - 1, 1) != 1) return false;
+    ll->has_newline = last == '\n';
+    if (ll->has_newline) ll->len--;
+    return true;
+}
+
+void long_line_close(LongLine *ll) {
+    if (ll->text) mem_release(2 * LONG_CHUNK);
+    free(ll->text);
+    free(ll->window);
+    ll->text = ll->window = NULL;
+}
+
+// find the first match at or after from, as find_match does for a line in memory. The line
+// is searched a chunk at a time; each chunk starts pattern_len - 1 bytes before the end of
+// the last so a match across the join isn't missed
+bool long_line_find(LongLine *ll, size_t from, const Options *opts, const regex_t *regex, MatchSpan *span) {
+    size_t keep = opts->pattern->len > 0 ? opts->pattern->len - 1 : 0;
+    size_t load = from;		// where the next chunk starts, if one is needed
+    bool loaded = ll->win_len > 0 && from >= ll->win_start && from <= ll->win_start + ll->win_len;
+    for (;;) {
+        if (!loaded) {
+            ll->win_start = load;
+            ll->win_len = long_line_read(ll, ll->window, load, ll->len - load < LONG_CHUNK ? ll->len - load : LONG_CHUNK);
+        }
+        if (find_match(ll->window, ll->win_len, from - ll->win_start, opts, regex, span)) {
+            span->start += ll->win_start;
+            span->end += ll->win_start;
+            return true;
+        }
+        // a match starting before win_end - keep would have ended inside this chunk
+        size_t win_end = ll->win_start + ll->win_len;
+        if (win_end >= ll->len || ll->win_len <= keep) return false;
+        load = win_end - keep;
+        if (from < load) from = load;
+        loaded = false;
+    }
+}
+
+// like next_match
+bool long_line_next(LongLine *ll, const Options *opts, const regex_t *regex, MatchSpan *span) {
+    size_t from = span->end > span->start ? span->end : span->end + 1;
+    if (from > ll->len) return false;
+    return long_line_find(ll, from, opts, regex, span);
+}
+
+// print line bytes [from, to) through the window (see out_window_piece). With --raw each byte
+// is a column, so only the visible part is read at all
+bool long_line_window(LongLine *ll, size_t from, size_t to, LineWindow *w, const char *open) {
+    bool raw = w->raw;
+    bool visible = false;
+    if (raw && w->col < w->first_col) {
+        size_t skip = w->first_col - w->col < to - from ? w->first_col - w->col : to - from;
+        from += skip;
+        w->col += skip;
+    }
+    while (from < to && w->col < w->end_col) {
+        size_t n = to - from < LONG_CHUNK ? to - from : LONG_CHUNK;
+        if (raw && n > w->end_col - w->col) n = w->end_col - w->col;
+        n = long_line_read(ll, ll->text, from, n);
+        if (n == 0) break;
+        if (raw) {
+            if (open && !visible) out_str(open);
+            visible = true;
+            out_write(ll->text, n);
+            w->col += n;
+        } else if (out_window_piece(w, ll->text, n, visible ? NULL : open)) {
+            visible = true;
+        }
+        from += n;
+    }
+    return visible;
+}
+
+// print_line for a long line
+void print_long_line(const LinePrefix *pre, LongLine *ll, int lineno, const Options *opts,
+                     const regex_t *regex, const MatchSpan *first) {
+    out_prefix(pre, lineno);
+    LineWindow w;
+    window_init(&w, opts);
+    size_t pos = 0;
+
+    if (first) {
+        MatchSpan span = *first;
+        for (;;) {
+            long_line_window(ll, pos, span.start, &w, NULL);
+            if (w.col >= w.end_col) break;
+            if (span.end > span.start && long_line_window(ll, span.start, span.end, &w, COLOR_MATCH))
+                out_str(COLOR_RESET);
+            pos = span.end;
+            if (!long_line_next(ll, opts, regex, &span)) break;
+        }
+    }
+    long_line_window(ll, pos, ll->len, &w, NULL);
+    out_eol();
+}
+
+// out_json_line for a long line
+void out_json_long_line(const char *filename, LongLine *ll, int lineno, LineKind kind,
+                        const Options *opts, const regex_t *regex, const MatchSpan *first) {
+    out_json_line_start(filename, lineno, ll->offset, kind);
+    out_putc('"');
+    bool invalid = false;
+    for (size_t pos = 0; pos < ll->len; ) {
+        size_t want = ll->len - pos < LONG_CHUNK ? ll->len - pos : LONG_CHUNK;
+        size_t n = long_line_read(ll, ll->text, pos, want);
+        if (n == 0) break;
+        // a character cut off at the end of the chunk starts the next one (unless the file
+        // ended early)
+        pos += out_json_chars(ll->text, n, n == want && pos + n < ll->len, &invalid);
+    }
+    out_putc('"');
+    if (invalid) {
+        // read it all again: in whole groups of 3 bytes, so the base64 joins up
+        out_str(",\"bytes\":\"");
+        for (size_t pos = 0; pos < ll->len; ) {
+            size_t want = ll->len - pos < LONG_CHUNK / 3 * 3 ? ll->len - pos : LONG_CHUNK / 3 * 3;
+            size_t n = long_line_read(ll, ll->text, pos, want);
+            if (n == 0) break;
+            out_base64((const unsigned char *)ll->text, n);
+            pos += n;
+        }
+        out_putc('"');
+    }
+    if (kind == LINE_MATCH) {
+        out_str(",\"spans\":[");
+        if (first) {
+            MatchSpan span = *first;
+            bool more = true;
+            for (bool comma = false; more; comma = true) {
+                out_json_span(&span, comma);
+                more = long_line_next(ll, opts, regex, &span);
+            }
+        }
+        out_putc(']');
+    }
+    out_putc('}');
+    out_eol();
+}
+
+// out_bin_line for a long line. The span count comes before the spans, so they are found
+// twice rather than kept
+void out_bin_long_line(unsigned file_id, LongLine *ll, int lineno, LineKind kind,
+                       const Options *opts, const regex_t *regex, const MatchSpan *first) {
+    size_t nspans = 0;
+    MatchSpan span;
+    if (first) {
+        span = *first;
+        do nspans++; while (long_line_next(ll, opts, regex, &span));
+    }
+
+    out_bin_line_start(file_id, ll->len, lineno, ll->offset, kind, opts, nspans);
+    if (first) {
+        span = *first;
+        do {
+            out_u64((unsigned long long)span.start);
+            out_u64((unsigned long long)span.end);
+        } while (long_line_next(ll, opts, regex, &span));
+    }
+    if (opts->with_lines) {
+        out_u64((unsigned long long)ll->len);
+        for (size_t pos = 0; pos < ll->len; ) {
+            size_t n = ll->len - pos < LONG_CHUNK ? ll->len - pos : LONG_CHUNK;
+            size_t got = long_line_read(ll, ll->text, pos, n);
+            memset(ll->text + got, 0, n - got);	// the record length is already written
+            out_write(ll->text, n);
+            pos += n;
+        }
+    }
+}
+
+
+// -----------------------------------------------------
+// ------------------ File Processing ------------------
+// -----------------------------------------------------
+
+// -b keeps only where each of the last N lines starts (8 bytes a line, however long the lines
+// are): line numbers follow from the position in the window and lengths from where the next
+// line starts. The bytes stay pinned in the reader's buffer, up to CONTEXT_PIN_MAX of them for
+// a seekable file; lines further back than that are read again if a match needs them
+#define CONTEXT_PIN_MAX (1024 * 1024)
+
+// --raw: a run of output lines that follow each other in the input file
+typedef struct {
+    bool active;
+    off_t start;			// file offsets of the run [start, end)
+    off_t end;
+    off_t kernel_from;		// the kernel will copy [kernel_from, end); -1 while we copy it ourselves
+    size_t out_mark;		// out.len when the run started, so its buffered bytes can be taken back
+    unsigned long writes;	// out.writes when the run started (the bytes are only there if unchanged)
+    bool add_newline;		// the last line of the file has no newline of its own
+} RawRun;
+
+// what the output routines need to know about the file being searched
+typedef struct {
+    const char *filename;
+    const Options *opts;
+    const regex_t *regex;
+    LinePrefix prefix;	// -f / -n prefix for each printed line
+    unsigned file_id;	// --format=binary: number of this file in the output stream
+    bool file_sent;		// --format=binary: the file's GGRB_REC_FILE record has been written
+    int in_fd;			// --raw: the input, if the kernel can copy from it (else -1)
+    RawRun run;			// --raw: output run not yet sent
+    int last_printed;	// -b / -a: line number of the last line output (0 = none yet)
+    bool block_open;	// -b / -a: a block of consecutive output lines has been started
+    LongLine long_line;	// a line too long to keep, read back from the file to output it
+} FileOut;
+
+// +++++++++++
+// Handle --raw: 1of3: lines go out as unchanged runs of the input. Runs stay in the buffer
+// until they reach ZERO_COPY_MIN bytes; then the bytes are taken back out of the buffer (if
+// it hasn't been written since) and the kernel copies the whole run when it ends
+// +++++++++++
+void raw_flush(FileOut *fo) {
+    RawRun *r = &fo->run;
+    if (!r->active) return;
+    r->active = false;
+    if (r->kernel_from < 0) return;	// already in the buffer
+
+    size_t n = (size_t)(r->end - r->kernel_from);
+    size_t done = out_kernel_copy(fo->in_fd, r->kernel_from, n);
+    if (done < n) out_copy_from_fd(fo->in_fd, r->kernel_from + (off_t)done, n - done);
+    if (r->add_newline) out_putc('\n');
+}
+
+// line[0..len) is a line (newline included) at offset in the input. line is NULL for a
+// long line that isn't in memory: it is always at least ZERO_COPY_MIN bytes, so the kernel
+// copies it
+void raw_line(FileOut *fo, const char *line, size_t len, off_t offset, bool has_newline) {
+    RawRun *r = &fo->run;
+    if (!r->active || offset != r->end) {
+        raw_flush(fo);
+        *r = (RawRun){true, offset, offset, -1, out.len, out.writes, false};
+    }
+    r->end = offset + (off_t)len;
+
+    if (r->kernel_from < 0 && r->end - r->start >= ZERO_COPY_MIN) {
+        if (r->writes == out.writes) {
+            out.len = r->out_mark;
+            r->kernel_from = r->start;
+        } else {
+            r->kernel_from = offset;	// the start of the run has gone already
+        }
+    }
+    if (r->kernel_from >= 0) {
+        r->add_newline = !has_newline;
+        return;
+    }
+    out_write(line, len);
+    if (!has_newline) out_putc('\n');
+}
+
+// --format=binary: name the file before its first record
+void announce_file(FileOut *fo) {
+    if (fo->file_sent) return;
+    out_bin_file(fo->file_id, fo->filename);
+    fo->file_sent = true;
+}
+
+// +++++++++++
+// Handle --raw: 2of3: the kernel can only copy for us if the lines go out unchanged and the
+// input is a regular file it can read at any offset. Returns the fd to copy from, or -1
+// +++++++++++
+int raw_input_fd(FILE *fp, const Options *opts) {
+    if (!opts->raw || out.zero_copy == ZC_NONE || opts->format != FORMAT_TEXT) return -1;
+    if (opts->show_line_numbers || opts->show_filename || opts->color) return -1;
+    if (opts->line_crop > 0 || opts->line_limit >= 0) return -1;
+
+    struct stat st;
+    int fd = fileno(fp);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    return fd;
+}
+
+// text output only: "---" before -b lines, "+++" after -a lines
+void emit_separator(FileOut *fo, const char *sep) {
+    if (fo->opts->format != FORMAT_TEXT) return;
+    raw_flush(fo);
+    out_str(sep);
+    out_eol();
+}
+
+// +++++++++++
+// Handle -b and -a: context blocks. Overlapping or touching before/after windows are merged
+// into one block of consecutive lines, each printed once. A block starts with "---" (if -b)
+// and ends with "+++" (if -a). A block is only closed when the next line printed doesn't
+// follow on from it (or at the end of the file), since a later match's -b lines may join it
+// +++++++++++
+void context_close(FileOut *fo) {
+    if (fo->block_open && fo->opts->after > 0) emit_separator(fo, "+++");
+    fo->block_open = false;
+}
+
+void context_line(FileOut *fo, int lineno) {
+    if (fo->opts->before == 0 && fo->opts->after == 0) return;
+    if (!fo->block_open || lineno != fo->last_printed + 1) {
+        context_close(fo);
+        if (fo->opts->before > 0) emit_separator(fo, "---");
+        fo->block_open = true;
+    }
+    fo->last_printed = lineno;
+}
+
+// +++++++++++
+// Handle long lines: 2of2: output a line that isn't in memory, reading it from the file again.
+// first is the first match span if the line has spans to show
+// +++++++++++
+void emit_long_line(FileOut *fo, size_t len, int lineno, off_t offset, LineKind kind,
+                    const MatchSpan *first) {
+    const Options *opts = fo->opts;
+    LongLine *ll = &fo->long_line;
+    if (!long_line_open(ll, offset, len)) {
+        // only pipe input gets here: --max-memory split a line it can't read again. ggrep
+        // goes on with the search, but exits non-zero
+        if (!mem.lost) fprintf(stderr, "%s: line %d is too long to output within --max-memory\n",
+                               fo->filename, lineno);
+        mem.lost++;
+        return;
+    }
+
+    if (fo->in_fd >= 0) {
+        raw_line(fo, NULL, len, offset, ll->has_newline);
+    } else if (opts->format == FORMAT_JSON) {
+        out_json_long_line(fo->filename, ll, lineno, kind, opts, fo->regex, first);
+    } else if (opts->format == FORMAT_BINARY) {
+        announce_file(fo);
+        out_bin_long_line(fo->file_id, ll, lineno, kind, opts, fo->regex, first);
+    } else {
+        print_long_line(&fo->prefix, ll, lineno, opts, fo->regex, opts->color ? first : NULL);
+    }
+}
+
+// +++++++++++
+// Handle --format and --json: 2of2: output a line in the chosen format
+// +++++++++++
+// line[0..len) is the line (with its newline) and offset where it is in the input; line
+// is NULL if the line was too long to keep in memory. first is the line's first match span
+// (only looked at for match lines)
+void emit_line(FileOut *fo, const char *line, size_t len, int lineno, off_t offset,
+               LineKind kind, const MatchSpan *first) {
+    const Options *opts = fo->opts;
+    context_line(fo, lineno);
+    // -r match lines don't contain a match, so have nothing to highlight or report
+    bool has_spans = kind == LINE_MATCH && !opts->reverse_find;
+
+    if (!line) {
+        // -E only knows that a long line matches, not where (--max-memory may split a line
+        // whose spans were wanted)
+        emit_long_line(fo, len, lineno, offset, kind, has_spans && !opts->use_regex ? first : NULL);
+        return;
+    }
+    if (fo->in_fd >= 0) {
+        raw_line(fo, line, len, offset, len > 0 && line[len - 1] == '\n');
+        return;
+    }
+
+    if (opts->format == FORMAT_JSON) {
+        out_json_line(fo->filename, line, len, lineno, offset, kind, opts, fo->regex,
+                      has_spans ? first : NULL);
+        return;
+    }
+    if (opts->format == FORMAT_BINARY) {
+        announce_file(fo);
+        out_bin_line(fo->file_id, line, len, lineno, offset, kind, opts, fo->regex,
+                     has_spans ? first : NULL);
+        return;
+    }
+// +++++++++++
+// Handle --color: 3of3: only lines that actually contain a match (not context lines, or -r
+// lines) get highlighting
+// +++++++++++
+    print_line(&fo->prefix, line, len, lineno, opts, fo->regex, has_spans && opts->color ? first : NULL);
+}
+
+void process_file(FILE *fp, const char *filename, const Options *opts, const regex_t *regex) {
+// +++++++++++
+// Handle -b: 1of3: create a buffer to capture rolling set of previous lines
+// +++++++++++
+    int before_size = opts->before;
+    off_t *before_buf = NULL;		// start of each line in the window
+	char *reread = NULL;			// lines read again because they left the reader's buffer
+	size_t reread_cap = 0;
+	if (before_size > 0) {
+		// --max-memory: only the offsets are kept, but -b can ask for a lot of them
+		if (!mem_fits((size_t)before_size * sizeof(off_t))) {
+			fprintf(stderr, "-b%d needs more memory than --max-memory allows\n", before_size);
+			exit(EXIT_FAILURE);
+		}
+		before_buf = xcalloc(before_size, sizeof(off_t));
+		mem_charge((size_t)before_size * sizeof(off_t));
+	}
+
+    LineReader reader;
+    reader_init(&reader, fileno(fp), filename);
+    const char *line;	// current line: a view into the reader's buffer
+    size_t nread;		// its length, including the newline
+    int lineno = 1;
+    int after_counter = 0;
+    int buf_pos = 0;
+    int buf_count = 0; // number of valid lines in circular buffer
+    int match_count = 0;
+    off_t offset;		// byte offset of the current line in the file
+    static unsigned next_file_id = 0;	// --format=binary numbers files in the order searched
+    FileOut fo = {.filename = filename, .opts = opts, .regex = regex, .file_id = next_file_id++};
+    fo.in_fd = raw_input_fd(fp, opts);
+    fo.long_line.fd = reader.seekable ? reader.fd : -1;
+    reader.split_long = long_lines_allowed(&reader, opts);
+    reader.can_split = long_lines_searchable(opts);
+    reader.overlap = opts->pattern->len > 0 && !opts->use_regex ? opts->pattern->len - 1 : 0;
+    prefix_init(&fo.prefix, filename, opts->show_filename, opts->show_line_numbers);
+
+// +++++++++++
+// Handle -F: show file name headers before the matched lines. 
+// +++++++++++
+	if(opts->filename_title && opts->format == FORMAT_TEXT) {
+		out_str("\n----------------------\nFile: ");
+		out_str(filename);
+		out_str("\n----------------------\n");
+	}
+
+    while (reader_next_line(&reader, &line, &nread, &offset)) {
+        // the text of the line without its newline is what we search
+        size_t text_len = nread;
+        if (text_len > 0 && line[text_len - 1] == '\n') text_len--;
+        MatchSpan first;	// where the first match is, for highlighting
+        bool match;
+
+// +++++++++++
+// Handle long lines: 1of2: a line too long for the reader's buffer comes in pieces. Search
+// them as they come; the line is read from the file again if it has to be output
+// +++++++++++
+        if (reader.partial) {
+            match = scan_long_line(&reader, line, nread, offset, &nread, opts, regex, &first);
+            line = NULL;
+        } else {
+            match = line_contains(line, text_len, opts, regex, &first);
+        }
+
+        // --- handle match ---
+        if (match) {
+// +++++++++++
+// Handle -m: 2of2: ONLY show file names where there are matches (not the matched lines). 
+// +++++++++++
+			if(opts->filename_only) {
+				if (opts->format == FORMAT_JSON) {
+					out_json_file("file", filename, NULL);
+				} else if (opts->format == FORMAT_BINARY) {
+					announce_file(&fo);
+					out_bin_matched_file(fo.file_id);
+				} else {
+					out_str("Match Found In: ");
+					out_str(filename);
+					out_eol();
+				}
+				reader_free(&reader);
+				prefix_free(&fo.prefix);
+				long_line_close(&fo.long_line);
+				return; // this is safe as -m turns off -b (no buffer cleanup needed) see 1of2
+				}
+
+			// without the -m option we process every line
+            match_count++;
+
+// +++++++++++
+// Handle -c: 1of3: don't print before lines if match count requested
+// +++++++++++
+// Handle -b: 2of3: print n lines from before the match; or as many as the buffer has,
+// skipping any already printed (as -a lines or the lines of an earlier match)
+// +++++++++++
+            // print before lines in chronological order
+            // this uses a circular buffer of size specified in the -b option
+			if (before_size > 0 && !opts->count_only ) { // only do this if there's a buffer or the mod can throw a runtime error
+				int start = (buf_pos + (before_size - buf_count)) % before_size;
+				for (int i = 0; i < buf_count; i++) {
+					int idx = (start + i) % before_size;
+					int before_lineno = lineno - buf_count + i;
+					if (before_lineno <= fo.last_printed) continue;
+
+					off_t line_start = before_buf[idx];
+					off_t line_end = i + 1 < buf_count ? before_buf[(idx + 1) % before_size] : offset;
+					size_t before_len = (size_t)(line_end - line_start);
+					if (reader.seekable && line_start < reader.buf_offset &&
+						(before_len >= LONG_LINE_MIN || !mem_fits(before_len))) {
+						// too long to read back into memory: output it straight from the file
+						emit_line(&fo, NULL, before_len, before_lineno, line_start, LINE_BEFORE, NULL);
+						continue;
+					}
+					const char *before_line = reader_view(&reader, line_start, before_len, &reread, &reread_cap);
+					if (before_line)
+						emit_line(&fo, before_line, before_len, before_lineno, line_start, LINE_BEFORE, NULL);
+					else
+						mem.lost++;		// let go over --max-memory, and not in a file to read again
+				}
+			}
+
+// +++++++++++
+// Handle -a: 1of2: set point from which we print n lines after the match; or as many as there are left in the file
+// +++++++++++
+            // set after-counter for printing lines after this match
+            after_counter = opts->after;
+        } 
+
+	// end of "if match" logic (still in while loop)
+
+// +++++++++++
+// Handle -c: 2of3: don't print after lines if match count requested
+// +++++++++++
+// Handle -a: 2of2: continue to print lines after the match until the counter runs down
+// +++++++++++
+        // --- print current line if match OR after-counter active ---
+        if ((match || after_counter > 0) && !opts->count_only){
+			emit_line(&fo, line, nread, lineno, offset,
+				match ? LINE_MATCH : LINE_AFTER, &first);
+            // decrement after-counter only for non-match lines 
+            if (!match && after_counter > 0) after_counter--;
+        }
+
+// +++++++++++
+// Handle -b: 3of3: push each line into the buffer (curcular) so historical lines can be printed 
+// +++++++++++
+        // --- update circular buffer for "before" lines ---
+        // only the line's position is stored; pinning the oldest line in the window keeps
+        // the bytes of all of them in the reader's buffer (within CONTEXT_PIN_MAX if the
+        // file can be read again)
+        if (before_size > 0) {
+			before_buf[buf_pos] = offset;
+            buf_pos = (buf_pos + 1) % before_size;
+            if (buf_count < before_size) buf_count++;
+            off_t oldest = before_buf[(buf_pos + (before_size - buf_count)) % before_size];
+            if (reader.seekable && offset - oldest > CONTEXT_PIN_MAX) oldest = offset - CONTEXT_PIN_MAX;
+            reader.keep_from = oldest;
+        }
+        
+        lineno++;
+    }
+
+    context_close(&fo);
+
+// +++++++++++
+// Handle --raw: 3of3: send whatever is left of the last run
+// +++++++++++
+    raw_flush(&fo);
+
+// +++++++++++
+// Handle -c: 3of3: print match count if requested
+// +++++++++++
+    if (opts->count_only && opts->format == FORMAT_JSON) {
+        out_json_file("count", filename, &match_count);
+    } else if (opts->count_only && opts->format == FORMAT_BINARY) {
+        announce_file(&fo);
+        out_bin_count(fo.file_id, match_count);
+    } else if (opts->count_only) {
+        out_str(get_basename(filename));
+        out_putc(':');
+        out_uint((unsigned long)match_count, 0);
+        out_eol();
+    }
+
+    // --- cleanup buffer ---
+    reader_free(&reader);
+    prefix_free(&fo.prefix);
+    long_line_close(&fo.long_line);
+	if (before_buf) {
+		free(before_buf);
+		mem_release((size_t)before_size * sizeof(off_t));
+	}
+	free(reread);
+	mem_release(reread_cap);
+}
+
+// open and search one file named on the command line
+void search_path(const char *path, const Options *opts, const regex_t *regex) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return;   // print error but continue
+    }
+    process_file(fp, path, opts, regex);
+    fclose(fp);
+}
+
+
+// -----------------------------------------------------
+// ------------------ Hot-first scheduling ------------------
+// -----------------------------------------------------
+// With --hot-first the files aren't searched in command line order. The ones that are
+// (nearly) all in the page cache go first, and their results are written out before any
+// disk read is waited for; mincore() on a mapping of the file says which pages are there.
+// The cold files follow in order, each with deeper readahead, and the next one's readahead
+// is started while the current one is searched, so its reads overlap our scanning
+#define HOT_PROBE_PAGES 16384		// pages asked about per mincore() call
+#define HOT_MISSING_PCT 10			// hot: no more than this % of the file has to be read
+#define COLD_READAHEAD (32 * 1024 * 1024)	// bytes asked for up front from a cold file
+
+#ifdef __linux__
+typedef unsigned char MincoreVec;
+#else
+typedef char MincoreVec;
+#endif
+
+typedef struct {
+    char *path;
+    bool hot;
+} QueuedFile;
+
+// is (nearly) all of the file at path in the page cache? Anything that isn't a regular file
+// counts as hot, so it keeps its place: it can't be probed, and opening a fifo could block
+bool file_is_hot(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return true;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return true;	// search_path reports the error
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return true;
+
+    static MincoreVec vec[HOT_PROBE_PAGES];
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = (size + page - 1) / page;
+    size_t allowed = pages * HOT_MISSING_PCT / 100;
+    size_t missing = 0;
+    for (size_t done = 0; done < pages && missing <= allowed; done += HOT_PROBE_PAGES) {
+        size_t n = pages - done < HOT_PROBE_PAGES ? pages - done : HOT_PROBE_PAGES;
+        size_t len = done + n == pages ? size - done * page : n * page;
+        if (mincore((char *)map + done * page, len, vec) != 0) {
+            missing = 0;	// can't tell: don't hold the file back
+            break;
+        }
+        for (size_t i = 0; i < n; i++)
+            if (!(vec[i] & 1)) missing++;
+    }
+    munmap(map, size);
+    return missing <= allowed;
+}
+
+// open a cold file and have the kernel start reading it: the whole file sequentially (which
+// widens the readahead window), and the first COLD_READAHEAD bytes straight away
+FILE *open_cold(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return NULL;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fileno(fp), 0, COLD_READAHEAD, POSIX_FADV_WILLNEED);
+#endif
+    return fp;
+}
+
+void search_hot_first(QueuedFile *files, int count, const Options *opts, const regex_t *regex) {
+    for (int i = 0; i < count; i++) files[i].hot = file_is_hot(files[i].path);
+    for (int i = 0; i < count; i++)
+        if (files[i].hot) search_path(files[i].path, opts, regex);
+    // the hot results go out now, not when the output buffer next fills
+    out_flush();
+
+    // search each cold file with the next one already opened and being read ahead
+    int i = 0;
+    while (i < count && files[i].hot) i++;
+    FILE *fp = i < count ? open_cold(files[i].path) : NULL;
+    while (i < count) {
+        int next = i + 1;
+        while (next < count && files[next].hot) next++;
+        FILE *next_fp = next < count ? open_cold(files[next].path) : NULL;
+        if (fp) {
+            process_file(fp, files[i].path, opts, regex);
+            fclose(fp);
+        }
+        fp = next_fp;
+        i = next;
+    }
+}
+
+// -----------------------------------------------------
+// ------------------ Trigram Query Planner ------------------
+// -----------------------------------------------------
+// Turns the pattern into a query over trigrams that every matching line satisfies, for the
+// index (see Trigram Index) to run: "abc" AND ("bcd" OR "xyz") and so on. A literal pattern
+// just needs all of its trigrams. A -E pattern is analysed as in Russ Cox's codesearch:
+// for each part of the regex we work out whether it can match the empty string, the exact
+// set of strings it matches (while that stays small), the sets of the first and last two
+// bytes of what it matches, and a query that any match satisfies. Putting parts side by
+// side gives trigrams that span the join; alternatives give OR. Repeats lose what's exact.
+// Strings are lower case, like the index. The query is Q_ALL (search every file) when
+// nothing useful can be said, such as for ".*" or a pattern the DFA doesn't handle
+#define PLAN_MAX_EXACT 16	// more exact strings than this and they are turned into a query
+#define PLAN_MAX_SET 32		// more prefixes (or suffixes) than this and they are given up
+#define PLAN_MAX_CLASS 8	// a bracket with more bytes than this is treated like .
+#define PLAN_MAX_TERMS 64	// more OR terms than a join of suffixes and prefixes makes: skip it
+
+typedef enum {
+    Q_ALL,		// every file
+    Q_NONE,		// no file (a trigram with a newline: lines don't have one)
+    Q_TRIGRAM,
+    Q_AND,
+    Q_OR
+} QueryOp;
+
+typedef struct Query {
+    QueryOp op;
+    uint32_t trigram;
+    struct Query **sub;	// Q_AND / Q_OR
+    int count;
+} Query;
+
+typedef struct {
+    char *p;
+    size_t len;
+} PlanString;
+
+// a set of strings, or (known false) "too many to list"
+typedef struct {
+    PlanString *s;
+    int count;
+    bool known;
+} StrSet;
+
+// what's known about a part of a regex
+typedef struct {
+    bool can_empty;		// it can match the empty string
+    StrSet exact;		// all it can match, if known
+    StrSet prefix;		// how what it matches starts: up to 2 bytes of each
+    StrSet suffix;		// and ends
+    Query *match;		// a query every match satisfies
+} PlanInfo;
+
+// the trigram of p[0..2] as the index has it (lower case)
+uint32_t trigram_of(const unsigned char *p) {
+    return ((uint32_t)tolower(p[0]) << 16) | ((uint32_t)tolower(p[1]) << 8) | (uint32_t)tolower(p[2]);
+}
+
+Query *query_new(QueryOp op) {
+    Query *q = xcalloc(1, sizeof(Query));
+    q->op = op;
+    return q;
+}
+
+void query_free(Query *q) {
+    if (!q) return;
+    for (int i = 0; i < q->count; i++) query_free(q->sub[i]);
+    free(q->sub);
+    free(q);
+}
+
+// a AND b, or a OR b (op), simplified: ALL and NONE are folded away and nested ops of the same
+// kind are flattened. Takes a and b over
+Query *query_join(QueryOp op, Query *a, Query *b) {
+    QueryOp absorb = op == Q_AND ? Q_NONE : Q_ALL;		// x AND NONE = NONE, x OR ALL = ALL
+    QueryOp neutral = op == Q_AND ? Q_ALL : Q_NONE;
+    if (a->op == absorb || b->op == neutral) {
+        query_free(b);
+        return a;
+    }
+    if (b->op == absorb || a->op == neutral) {
+        query_free(a);
+        return b;
+    }
+    Query *q = query_new(op);
+    Query *parts[2] = {a, b};
+    for (int i = 0; i < 2; i++) {
+        Query *p = parts[i];
+        bool flatten = p->op == op;
+        int n = flatten ? p->count : 1;
+        Query **subs = flatten ? p->sub : &parts[i];
+        q->sub = xrealloc(q->sub, (size_t)(q->count + n) * sizeof(Query *));
+        for (int k = 0; k < n; k++) {
+            // the same trigram twice adds nothing
+            bool dup = false;
+            for (int j = 0; j < q->count && subs[k]->op == Q_TRIGRAM; j++)
+                dup |= q->sub[j]->op == Q_TRIGRAM && q->sub[j]->trigram == subs[k]->trigram;
+            if (dup) query_free(subs[k]);
+            else q->sub[q->count++] = subs[k];
+        }
+        if (flatten) {
+            free(p->sub);
+            free(p);
+        }
+    }
+    return q;
+}
+
+// every trigram of p[0..len) (ALL if it's too short to have one)
+Query *query_string(const char *p, size_t len) {
+    Query *q = query_new(Q_ALL);
+    for (size_t i = 0; i + 3 <= len; i++) {
+        const unsigned char *t = (const unsigned char *)p + i;
+        Query *leaf = query_new(Q_TRIGRAM);
+        if (t[0] == '\n' || t[1] == '\n' || t[2] == '\n') leaf->op = Q_NONE;
+        else leaf->trigram = trigram_of(t);
+        q = query_join(Q_AND, q, leaf);
+    }
+    return q;
+}
+
+// some string of the set: the OR of their queries
+Query *query_strset(const StrSet *set) {
+    if (!set->known) return query_new(Q_ALL);
+    Query *q = query_new(Q_NONE);
+    for (int i = 0; i < set->count; i++) q = query_join(Q_OR, q, query_string(set->s[i].p, set->s[i].len));
+    return q;
+}
+
+// write the query out, as --explain shows it
+void query_print(FILE *fp, const Query *q, bool top) {
+    switch (q->op) {
+        case Q_ALL: fprintf(fp, "ALL"); break;
+        case Q_NONE: fprintf(fp, "NONE"); break;
+        case Q_TRIGRAM: {
+            fputc('"', fp);
+            for (int shift = 16; shift >= 0; shift -= 8) {
+                unsigned char c = (unsigned char)(q->trigram >> shift);
+                if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+                else if (isprint(c)) fputc(c, fp);
+                else fprintf(fp, "\\x%02x", c);
+            }
+            fputc('"', fp);
+            break;
+        }
+        default:
+            if (!top) fputc('(', fp);
+            for (int i = 0; i < q->count; i++) {
+                if (i) fprintf(fp, q->op == Q_AND ? " AND " : " OR ");
+                query_print(fp, q->sub[i], false);
+            }
+            if (!top) fputc(')', fp);
+    }
+}
+
+StrSet strset_new(void) {
+    return (StrSet){NULL, 0, true};
+}
+
+void strset_free(StrSet *set) {
+    for (int i = 0; i < set->count; i++) free(set->s[i].p);
+    free(set->s);
+    *set = (StrSet){NULL, 0, false};
+}
+
+// add p[0..len) (lower case) unless it's there already; past limit strings the set is unknown
+void strset_add(StrSet *set, const char *p, size_t len, int limit) {
+    if (!set->known) return;
+    for (int i = 0; i < set->count; i++)
+        if (set->s[i].len == len && memcmp(set->s[i].p, p, len) == 0) return;
+    if (set->count == limit) {
+        strset_free(set);
+        return;
+    }
+    set->s = xrealloc(set->s, (size_t)(set->count + 1) * sizeof(PlanString));
+    char *copy = xmalloc(len ? len : 1);
+    for (size_t i = 0; i < len; i++) copy[i] = (char)tolower((unsigned char)p[i]);
+    set->s[set->count++] = (PlanString){copy, len};
+}
+
+// a set with just the empty string: nothing is known about how things start or end
+StrSet strset_empty(void) {
+    StrSet set = strset_new();
+    strset_add(&set, "", 0, PLAN_MAX_SET);
+    return set;
+}
+
+// each a followed by each b, keeping only the first 2 bytes (keep_end false) or the last 2
+// of each result (keep_end true) if trim is set
+StrSet strset_cross(const StrSet *a, const StrSet *b, int limit, bool trim, bool keep_end) {
+    StrSet cross = strset_new();
+    if (!a->known || !b->known) {
+        strset_free(&cross);
+        return cross;
+    }
+    char buf[8];
+    for (int i = 0; i < a->count && cross.known; i++) {
+        for (int k = 0; k < b->count && cross.known; k++) {
+            size_t n = a->s[i].len + b->s[k].len;
+            char *joined = n <= sizeof(buf) ? buf : xmalloc(n);
+            memcpy(joined, a->s[i].p, a->s[i].len);
+            memcpy(joined + a->s[i].len, b->s[k].p, b->s[k].len);
+            size_t from = 0;
+            size_t len = n;
+            if (trim && n > 2) {
+                len = 2;
+                if (keep_end) from = n - 2;
+            }
+            strset_add(&cross, joined + from, len, limit);
+            if (joined != buf) free(joined);
+        }
+    }
+    return cross;
+}
+
+// a copy of set (or of "" if it's unknown: an unknown prefix set says nothing) with each
+// string cut to its first (or last) 2 bytes
+StrSet strset_ends(const StrSet *set, bool keep_end) {
+    if (!set->known) return strset_empty();
+    StrSet ends = strset_new();
+    for (int i = 0; i < set->count; i++) {
+        size_t len = set->s[i].len > 2 ? 2 : set->s[i].len;
+        size_t from = keep_end ? set->s[i].len - len : 0;
+        strset_add(&ends, set->s[i].p + from, len, PLAN_MAX_SET);
+    }
+    if (!ends.known) return strset_empty();
+    return ends;
+}
+
+void strset_union(StrSet *a, const StrSet *b, int limit) {
+    if (!b->known) {
+        strset_free(a);
+        return;
+    }
+    for (int i = 0; i < b->count && a->known; i++) strset_add(a, b->s[i].p, b->s[i].len, limit);
+}
+
+void info_free(PlanInfo *x) {
+    strset_free(&x->exact);
+    strset_free(&x->prefix);
+    strset_free(&x->suffix);
+    query_free(x->match);
+}
+
+// matches just the strings in exact (all known)
+PlanInfo info_exact(StrSet exact, bool can_empty) {
+    PlanInfo x = {.can_empty = can_empty, .exact = exact};
+    x.prefix = strset_ends(&exact, false);
+    x.suffix = strset_ends(&exact, true);
+    x.match = query_new(Q_ALL);
+    return x;
+}
+
+// matches something we know nothing about (at least a byte long unless can_empty)
+PlanInfo info_any(bool can_empty) {
+    PlanInfo x = {.can_empty = can_empty, .exact = strset_new()};
+    strset_free(&x.exact);
+    x.prefix = strset_empty();
+    x.suffix = strset_empty();
+    x.match = query_new(Q_ALL);
+    return x;
+}
+
+// stop tracking the exact strings: what they say goes into the match query
+void info_drop_exact(PlanInfo *x) {
+    if (!x->exact.known) return;
+    x->match = query_join(Q_AND, x->match, query_strset(&x->exact));
+    strset_free(&x->exact);
+}
+
+// x followed by y (takes both over)
+PlanInfo info_concat(PlanInfo x, PlanInfo y) {
+    PlanInfo z = {.can_empty = x.can_empty && y.can_empty};
+    z.exact = strset_cross(&x.exact, &y.exact, PLAN_MAX_EXACT, false, false);
+    if (z.exact.known) {
+        z.prefix = strset_ends(&z.exact, false);
+        z.suffix = strset_ends(&z.exact, true);
+        z.match = query_join(Q_AND, x.match, y.match);
+        x.match = y.match = NULL;
+    } else {
+        // how it starts: x's start, joined to y's if x is exact (and short)
+        if (x.exact.known) z.prefix = strset_cross(&x.exact, &y.prefix, PLAN_MAX_SET, true, false);
+        else z.prefix = strset_ends(&x.prefix, false);
+        if (!z.prefix.known || (x.can_empty && !x.exact.known)) {
+            strset_free(&z.prefix);
+            z.prefix = strset_empty();
+        }
+        if (y.exact.known) z.suffix = strset_cross(&x.suffix, &y.exact, PLAN_MAX_SET, true, true);
+        else z.suffix = strset_ends(&y.suffix, true);
+        if (!z.suffix.known || (y.can_empty && !y.exact.known)) {
+            strset_free(&z.suffix);
+            z.suffix = strset_empty();
+        }
+        info_drop_exact(&x);
+        info_drop_exact(&y);
+        z.match = query_join(Q_AND, x.match, y.match);
+        x.match = y.match = NULL;
+
+        // the trigrams across the join: some suffix of x then some prefix of y
+        if (x.suffix.count * y.prefix.count <= PLAN_MAX_TERMS) {
+            StrSet joins = strset_cross(&x.suffix, &y.prefix, PLAN_MAX_TERMS, false, false);
+            z.match = query_join(Q_AND, z.match, query_strset(&joins));
+            strset_free(&joins);
+        }
+    }
+    info_free(&x);
+    info_free(&y);
+    return z;
+}
+
+// x or y (takes both over)
+PlanInfo info_alt(PlanInfo x, PlanInfo y) {
+    PlanInfo z = {.can_empty = x.can_empty || y.can_empty};
+    if (x.exact.known && y.exact.known) {
+        z.exact = strset_new();
+        strset_union(&z.exact, &x.exact, PLAN_MAX_EXACT);
+        strset_union(&z.exact, &y.exact, PLAN_MAX_EXACT);
+    } else {
+        z.exact = strset_new();
+        strset_free(&z.exact);
+    }
+    if (!z.exact.known) {
+        info_drop_exact(&x);
+        info_drop_exact(&y);
+    }
+    z.prefix = strset_new();
+    strset_union(&z.prefix, &x.prefix, PLAN_MAX_SET);
+    strset_union(&z.prefix, &y.prefix, PLAN_MAX_SET);
+    if (!z.prefix.known) z.prefix = strset_empty();
+    z.suffix = strset_new();
+    strset_union(&z.suffix, &x.suffix, PLAN_MAX_SET);
+    strset_union(&z.suffix, &y.suffix, PLAN_MAX_SET);
+    if (!z.suffix.known) z.suffix = strset_empty();
+    z.match = query_join(Q_OR, x.match, y.match);
+    x.match = y.match = NULL;
+    info_free(&x);
+    info_free(&y);
+    return z;
+}
+
+// x one or more times: how it starts and ends, and its query, still hold
+PlanInfo info_plus(PlanInfo x) {
+    info_drop_exact(&x);
+    return x;
+}
+
+// x zero or more times: nothing can be said
+PlanInfo info_star(PlanInfo x) {
+    bool can_empty = true;
+    info_free(&x);
+    return info_any(can_empty);
+}
+
+// x or nothing
+PlanInfo info_quest(PlanInfo x) {
+    StrSet empty = strset_new();
+    strset_add(&empty, "", 0, PLAN_MAX_EXACT);
+    return info_alt(x, info_exact(empty, true));
+}
+
+PlanInfo plan_alternation(StreamRegex *re);
+
+// one atom, as sre_atom reads it (the pattern is known to be one the DFA takes)
+PlanInfo plan_atom(StreamRegex *re, bool *end) {
+    unsigned char c = (unsigned char)re->pat[re->pos];
+    StrSet one = strset_new();
+    *end = false;
+    if (c == '\\') {
+        unsigned char e = (unsigned char)re->pat[re->pos + 1];
+        if (e == ')' || e == '|') {
+            *end = true;
+            return info_any(true);
+        }
+        re->pos += 2;
+        if (e == '(') {
+            PlanInfo x = plan_alternation(re);
+            re->pos += 2;	// the \)
+            return x;
+        }
+        strset_add(&one, (const char *)&e, 1, PLAN_MAX_EXACT);
+        return info_exact(one, false);
+    }
+    re->pos++;
+    if (c == '.') return info_any(false);
+    if (c == '[') {
+        // a small bracket is a few exact one byte strings
+        ByteSet set = sre_bracket_set(re);
+        for (int b = 0; b < 256 && one.known; b++) {
+            char byte = (char)tolower(b);
+            if (byteset_has(&set, (unsigned char)b)) strset_add(&one, &byte, 1, PLAN_MAX_CLASS);
+        }
+        if (!one.known) return info_any(false);
+        return info_exact(one, false);
+    }
+    strset_add(&one, (const char *)&c, 1, PLAN_MAX_EXACT);
+    return info_exact(one, false);
+}
+
+// a branch, as sre_branch reads it
+PlanInfo plan_branch(StreamRegex *re) {
+    StrSet empty = strset_new();
+    strset_add(&empty, "", 0, PLAN_MAX_EXACT);
+    PlanInfo branch = info_exact(empty, true);
+
+    if (sre_peek(re, "^")) re->pos++;	// anchors match the empty string
+    while (re->pos < re->len) {
+        if (re->pat[re->pos] == '$' && (re->pos + 1 == re->len || sre_peek(re, "$\\)") || sre_peek(re, "$\\|"))) {
+            re->pos++;
+            continue;
+        }
+        bool end;
+        PlanInfo atom = plan_atom(re, &end);	// a leading * is an ordinary byte, as it is there
+        if (end) {
+            info_free(&atom);
+            break;
+        }
+        for (;;) {
+            if (sre_peek(re, "*")) {
+                re->pos++;
+                atom = info_star(atom);
+            } else if (sre_peek(re, "\\+")) {
+                re->pos += 2;
+                atom = info_plus(atom);
+            } else if (sre_peek(re, "\\?")) {
+                re->pos += 2;
+                atom = info_quest(atom);
+            } else if (sre_peek(re, "\\{")) {
+                char *p;
+                long lo = strtol(re->pat + re->pos + 2, &p, 10);
+                re->pos = (size_t)(strstr(p, "\\}") - re->pat) + 2;
+                atom = lo == 0 ? info_star(atom) : info_plus(atom);
+            } else {
+                break;
+            }
+        }
+        branch = info_concat(branch, atom);
+    }
+    return branch;
+}
+
+PlanInfo plan_alternation(StreamRegex *re) {
+    PlanInfo x = plan_branch(re);
+    while (sre_peek(re, "\\|")) {
+        re->pos += 2;
+        x = info_alt(x, plan_branch(re));
+    }
+    return x;
+}
+
+// the trigram query for the pattern: every line that matches it satisfies the query
+Query *plan_query(const Options *opts) {
+    const Pattern *pat = opts->pattern;
+    if (opts->reverse_find) return query_new(Q_ALL);	// -r lines are the ones without a match
+    if (!opts->use_regex) return query_string(pat->bytes, pat->len);
+    if (!opts->stream) return query_new(Q_ALL);			// a regex the DFA (and so we) can't read
+
+    StreamRegex re = {.pat = pat->bytes, .len = pat->len, .icase = opts->ignore_case};
+    PlanInfo x = plan_alternation(&re);
+    info_drop_exact(&x);
+    Query *q = x.match;
+    x.match = NULL;
+    if (x.can_empty) {
+        query_free(q);	// every line has the empty string in it
+        q = query_new(Q_ALL);
+    }
+    info_free(&x);
+    return q;
+}
+
+// -----------------------------------------------------
+// ------------------ Trigram Index ------------------
+// -----------------------------------------------------
+// "ggrep --index build DIR" walks DIR and writes DIR/.ggrep_index: for every 3 byte sequence
+// (trigram) in the files, the list of files that contain it (its posting list). Then
+// "ggrep --index DIR pattern" only has to read the files that have the trigrams the
+// pattern needs (all of a literal's; for -E, what the Trigram Query Planner works out);
+// the rest can't match. Trigrams are of lower-cased bytes, so one index serves
+// both case-sensitive and -i searches (the first just gets a few more candidates). Each
+// candidate is searched as usual, so the results are those of searching every file in the
+// tree in path order. The index also keeps each file's size, mtime and inode: a file that
+// has changed since it was indexed, or is new, is always searched, so a stale index is only
+// slower, never wrong. Files are regular files found without following symlinks.
+// "--index update DIR" indexes just the new and changed files, into a segment of their own
+// (DIR/.ggrep_index.1, .2, ...); the newest segment with a file's entry is the one used.
+// "--index merge DIR" (or an update once there are INDEX_MAX_SEGMENTS) folds the segments
+// back into one, from the postings alone, without reading any file.
+// "--index build DIR --shards=N" splits the index into N shards by a hash of each file's path
+// (DIR/.ggrep_index, .ggrep_index-1 ...). Each shard is an index of just its files, with
+// updates of its own, and the shards are built, updated, merged and searched by a process
+// each, all at once. A search puts the output of the shards back together in path order.
+// The memory a build takes doesn't grow with the tree: the files' trigrams are collected
+// INDEX_BATCH_PAIRS at a time, each batch is written as an index of its own (a part:
+// DIR/.ggrep_index.part0 ...), and the parts are merged like segments, a posting list at a
+// time. A posting list is written as soon as it's complete, so none is kept once written.
+//
+// Each segment file, in native byte order:
+//     IndexHeader
+//     IndexEntry [file_count]         sorted by path
+//     postings                        each trigram's file numbers, ascending, compressed (see
+//                                     Posting lists), then POSTINGS_PAD zero bytes and up to
+//                                     7 more, to align the trigrams
+//     IndexTrigram [trigram_count]    sorted by trigram
+//     char names[]                    the paths relative to DIR, each NUL terminated
+#define INDEX_NAME ".ggrep_index"
+#define INDEX_MAGIC "GGIX"
+#define INDEX_VERSION 1
+#ifndef INDEX_BATCH_PAIRS
+#define INDEX_BATCH_PAIRS (1 << 23)	// (trigram, file) pairs collected before a part is written: 64 MB
+#endif
+#define TRIGRAMS (1 << 24)
+#define INDEX_MAX_SEGMENTS 8	// the base and the updates since: one more update merges them
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t file_count;
+    uint32_t trigram_count;
+    uint64_t entries_at;	// byte offsets in the file of each part
+    uint64_t trigrams_at;
+    uint64_t postings_at;
+    uint64_t names_at;
+} IndexHeader;
+
+typedef struct {
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t inode;
+    uint64_t name;		// offset in names
+} IndexEntry;
+
+typedef struct {
+    uint32_t trigram;
+    uint32_t count;		// files in its posting list
+    uint64_t at;		// byte offset in postings of the list
+} IndexTrigram;
+
+// a file found in the tree
+typedef struct {
+    char *path;			// relative to the tree's directory
+    IndexEntry stat;
+} TreeFile;
+
+typedef struct {
+    TreeFile *files;
+    size_t count;
+    size_t cap;
+} TreeList;
+
+// an index file mapped into memory
+typedef struct {
+    const char *map;
+    size_t map_len;
+    const IndexHeader *header;
+    const IndexEntry *entries;
+    const IndexTrigram *trigrams;
+    const unsigned char *postings;
+    const char *names;
+    char *path;			// for saying it's unreadable
+} Index;
+
+// ------------------ Posting lists ------------------
+// A posting list is a trigram's file numbers in ascending order. They're stored as the gaps
+// between them (the first as it is), which are mostly small, in the stream-vbyte format: a
+// control byte for each 4 numbers, giving each one's length in bytes less 1 (2 bits each,
+// the first in the low bits), then all the numbers' bytes, little endian, with nothing in
+// between. The lengths are all in one place, so 4 numbers can be unpacked with one byte
+// shuffle picked by their control byte, and the gaps turned back into file numbers with a
+// couple of vector adds. The common trigrams of a big tree have lists of millions of files:
+// these take about a third of the space of plain uint32_t, and decode at about a file per ns.
+// The decoder may read up to 16 bytes past a list's end, so the postings are followed
+// by POSTINGS_PAD bytes
+#define POSTINGS_PAD 16
+
+// a decoded list (or the result of a query on some)
+typedef struct {
+    uint32_t *files;
+    uint32_t count;
+} PostingList;
+
+// for each control byte, the shuffle that spreads its 4 numbers' bytes over 4 uint32_t
+// (0x80: a zero byte), and how many bytes they take
+unsigned char postings_shuffle[256][16];
+unsigned char postings_length[256];
+bool postings_tables_made;
+
+void postings_make_tables(void) {
+    for (int c = 0; c < 256; c++) {
+        int at = 0;
+        for (int i = 0; i < 4; i++) {
+            int len = ((c >> (2 * i)) & 3) + 1;
+            for (int b = 0; b < 4; b++) postings_shuffle[c][4 * i + b] = b < len ? (unsigned char)(at + b) : 0x80;
+            at += len;
+        }
+        postings_length[c] = (unsigned char)at;
+    }
+    postings_tables_made = true;
+}
+
+// the most bytes count file numbers can take
+size_t postings_bound(size_t count) {
+    return (count + 3) / 4 + 4 * count;
+}
+
+// the bytes the list of count files at in takes (its control bytes say how long its data
+// is), or SIZE_MAX if that's more than avail
+size_t postings_size(const unsigned char *in, uint32_t count, size_t avail) {
+    size_t control = (count + 3) / 4;
+    if (control > avail) return SIZE_MAX;
+    if (!postings_tables_made) postings_make_tables();
+    size_t len = control;
+    for (uint32_t i = 0; i < count / 4; i++) len += postings_length[in[i]];
+    for (uint32_t i = count / 4 * 4; i < count; i++) len += ((in[i / 4] >> (2 * (i % 4))) & 3) + 1u;
+    return len <= avail ? len : SIZE_MAX;
+}
+
+// write files[0..count) (ascending) to dst as a posting list. Returns the bytes written
+size_t postings_encode(const uint32_t *files, uint32_t count, unsigned char *dst) {
+    unsigned char *control = dst;
+    unsigned char *data = dst + (count + 3) / 4;
+    uint32_t prev = 0;
+    memset(control, 0, (count + 3) / 4);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t gap = files[i] - prev;
+        prev = files[i];
+        int len = gap < (1u << 8) ? 1 : gap < (1u << 16) ? 2 : gap < (1u << 24) ? 3 : 4;
+        control[i / 4] |= (unsigned char)((len - 1) << (2 * (i % 4)));
+        for (int b = 0; b < len; b++) *data++ = (unsigned char)(gap >> (8 * b));
+    }
+    return (size_t)(data - dst);
+}
+
+// decode the last count numbers of a list (fewer than 4, or all of them where there's no
+// vector shuffle): control and data are where they start, prev the file before them
+void postings_decode_tail(const unsigned char *control, const unsigned char *data, uint32_t count,
+                          uint32_t prev, uint32_t *dst) {
+    for (uint32_t i = 0; i < count; i++) {
+        int len = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+        uint32_t gap = 0;
+        for (int b = 0; b < len; b++) gap |= (uint32_t)data[b] << (8 * b);
+        data += len;
+        prev += gap;
+        dst[i] = prev;
+    }
+}
+
+#if defined(__SSE2__)
+// 4 numbers per step with pshufb: SSSE3, which not every x86-64 has, so this is compiled for
+// it on its own and only called if the CPU has it
+__attribute__((target("ssse3")))
+void postings_decode_ssse3(const unsigned char *in, uint32_t count, uint32_t *dst) {
+    const unsigned char *control = in;
+    const unsigned char *data = in + (count + 3) / 4;
+    __m128i prev = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        unsigned c = control[i / 4];
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(const void *)data);
+        __m128i gaps = _mm_shuffle_epi8(bytes, _mm_loadu_si128((const __m128i *)(const void *)postings_shuffle[c]));
+        // running sum: each lane adds the ones before it, then the last file of the step before
+        gaps = _mm_add_epi32(gaps, _mm_slli_si128(gaps, 4));
+        gaps = _mm_add_epi32(gaps, _mm_slli_si128(gaps, 8));
+        __m128i files = _mm_add_epi32(gaps, prev);
+        _mm_storeu_si128((__m128i *)(void *)(dst + i), files);
+        prev = _mm_shuffle_epi32(files, 0xFF);
+        data += postings_length[c];
+    }
+    postings_decode_tail(control + i / 4, data, count - i, (uint32_t)_mm_cvtsi128_si32(prev), dst + i);
+}
+#elif defined(__aarch64__)
+void postings_decode_neon(const unsigned char *in, uint32_t count, uint32_t *dst) {
+    const unsigned char *control = in;
+    const unsigned char *data = in + (count + 3) / 4;
+    const uint32x4_t zero = vdupq_n_u32(0);
+    uint32x4_t prev = zero;
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        unsigned c = control[i / 4];
+        uint8x16_t bytes = vqtbl1q_u8(vld1q_u8(data), vld1q_u8(postings_shuffle[c]));
+        uint32x4_t gaps = vreinterpretq_u32_u8(bytes);
+        gaps = vaddq_u32(gaps, vextq_u32(zero, gaps, 3));
+        gaps = vaddq_u32(gaps, vextq_u32(zero, gaps, 2));
+        uint32x4_t files = vaddq_u32(gaps, prev);
+        vst1q_u32(dst + i, files);
+        prev = vdupq_laneq_u32(files, 3);
+        data += postings_length[c];
+    }
+    postings_decode_tail(control + i / 4, data, count - i, vgetq_lane_u32(prev, 0), dst + i);
+}
+#endif
+
+// decode the list of count files at in into dst
+void postings_decode(const unsigned char *in, uint32_t count, uint32_t *dst) {
+    if (!postings_tables_made) postings_make_tables();
+#if defined(__SSE2__)
+    if (__builtin_cpu_supports("ssse3")) {
+        postings_decode_ssse3(in, count, dst);
+        return;
+    }
+#elif defined(__aarch64__)
+    postings_decode_neon(in, count, dst);
+    return;
+#endif
+    postings_decode_tail(in, in + (count + 3) / 4, count, 0, dst);
+}
+
+// the files in both a and b. Lists of about the same length are merged; otherwise each file of
+// the shorter list is looked for in the longer by galloping from where the last one was:
+// steps of 1, 2, 4 ... until past it, then a binary search of the last step. A short list
+// against a long one reads little of the long one
+#define POSTINGS_GALLOP_RATIO 16	// gallop when one list is this many times the other
+
+PostingList postings_intersect(PostingList a, PostingList b) {
+    if (a.count > b.count) {
+        PostingList t = a;
+        a = b;
+        b = t;
+    }
+    PostingList both = {xmalloc((a.count ? a.count : 1) * sizeof(uint32_t)), 0};
+    if (b.count / POSTINGS_GALLOP_RATIO <= a.count) {
+        uint32_t i = 0;
+        uint32_t k = 0;
+        while (i < a.count && k < b.count) {
+            if (a.files[i] < b.files[k]) i++;
+            else if (b.files[k] < a.files[i]) k++;
+            else {
+                both.files[both.count++] = a.files[i++];
+                k++;
+            }
+        }
+        return both;
+    }
+    uint32_t at = 0;
+    for (uint32_t i = 0; i < a.count && at < b.count; i++) {
+        uint32_t want = a.files[i];
+        uint32_t lo = at;
+        uint32_t step = 1;
+        while (lo + step < b.count && b.files[lo + step] < want) {
+            lo += step;
+            step *= 2;
+        }
+        uint32_t hi = lo + step < b.count ? lo + step : b.count;	// b.files[hi] >= want, if there
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (b.files[mid] < want) lo = mid + 1;
+            else hi = mid;
+        }
+        at = lo;
+        if (at < b.count && b.files[at] == want) both.files[both.count++] = want;
+    }
+    return both;
+}
+
+// the files in a or b
+PostingList postings_union(PostingList a, PostingList b) {
+    PostingList either = {xmalloc(((size_t)a.count + b.count + 1) * sizeof(uint32_t)), 0};
+    uint32_t i = 0;
+    uint32_t k = 0;
+    while (i < a.count || k < b.count) {
+        uint32_t f;
+        if (k == b.count || (i < a.count && a.files[i] < b.files[k])) f = a.files[i++];
+        else if (i == a.count || b.files[k] < a.files[i]) f = b.files[k++];
+        else {
+            f = a.files[i++];
+            k++;
+        }
+        either.files[either.count++] = f;
+    }
+    return either;
+}
+
+// dir/name in a new buffer
+char *path_join(const char *dir, const char *name) {
+    size_t d = strlen(dir);
+    size_t n = strlen(name);
+    bool slash = d > 0 && dir[d - 1] != '/';
+    char *path = xmalloc(d + slash + n + 1);
+    memcpy(path, dir, d);
+    if (slash) path[d] = '/';
+    memcpy(path + d + slash, name, n + 1);
+    return path;
+}
+
+int tree_file_cmp(const void *a, const void *b) {
+    return strcmp(((const TreeFile *)a)->path, ((const TreeFile *)b)->path);
+}
+
+// is name (at the top of the tree) one of the index's files? INDEX_NAME, then optionally
+// -shard, .segment, .partN and .tmp, in that order. Anything else, like .ggrep_index_notes,
+// is a file of the tree like any other
+bool index_file_name(const char *name) {
+    size_t n = strlen(INDEX_NAME);
+    if (strncmp(name, INDEX_NAME, n) != 0) return false;
+    name += n;
+    static const char *const suffixes[] = {"-", ".", ".part"};	// each followed by digits
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        size_t len = strlen(suffixes[i]);
+        if (strncmp(name, suffixes[i], len) != 0 || !isdigit((unsigned char)name[len])) continue;
+        name += len;
+        while (isdigit((unsigned char)*name)) name++;
+    }
+    if (strcmp(name, ".tmp") == 0) name += 4;
+    return *name == '\0';
+}
+
+// add the regular files under root/rel (rel is "" at the top) to list
+void tree_walk(const char *root, const char *rel, TreeList *list) {
+    char *dir_path = *rel ? path_join(root, rel) : xmalloc(strlen(root) + 1);
+    if (!*rel) strcpy(dir_path, root);
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        perror(dir_path);
+        free(dir_path);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (!*rel && index_file_name(de->d_name)) continue;
+        char *child = *rel ? path_join(rel, de->d_name) : path_join("", de->d_name);
+        char *full = path_join(root, child);
+        struct stat st;
+        if (lstat(full, &st) != 0) {
+            perror(full);
+        } else if (S_ISDIR(st.st_mode)) {
+            tree_walk(root, child, list);
+        } else if (S_ISREG(st.st_mode)) {
+            if (list->count == list->cap) {
+                list->cap = list->cap ? list->cap * 2 : 256;
+                list->files = xrealloc(list->files, list->cap * sizeof(TreeFile));
+            }
+            TreeFile *f = &list->files[list->count++];
+            f->path = child;
+            child = NULL;
+            f->stat = (IndexEntry){.size = (uint64_t)st.st_size, .inode = (uint64_t)st.st_ino,
+                                   .mtime_sec = (int64_t)st.st_mtime,
+#ifdef __APPLE__
+                                   .mtime_nsec = (int64_t)st.st_mtimespec.tv_nsec};
+#else
+                                   .mtime_nsec = (int64_t)st.st_mtim.tv_nsec};
+#endif
+        }
+        free(child);
+        free(full);
+    }
+    closedir(dir);
+    free(dir_path);
+}
+
+// all the regular files under root, sorted by path
+TreeList tree_list(const char *root) {
+    TreeList list = {NULL, 0, 0};
+    tree_walk(root, "", &list);
+    if (list.count) qsort(list.files, list.count, sizeof(TreeFile), tree_file_cmp);
+    return list;
+}
+
+void tree_free(TreeList *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->files[i].path);
+    free(list->files);
+    *list = (TreeList){NULL, 0, 0};
+}
+
+// append (trigram << 32 | file) for each different trigram in the file at path to *pairs.
+// seen has a bit per trigram, all clear, and is left that way
+void index_file_trigrams(const char *path, uint32_t file, uint64_t *seen,
+                         uint64_t **pairs, size_t *count, size_t *cap) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    size_t first = *count;
+    unsigned char buf[READ_BLOCK_SIZE + 2];
+    size_t have = 0;		// bytes carried over from the last block (the last two)
+    for (;;) {
+        ssize_t n = read(fd, buf + have, READ_BLOCK_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) perror(path);
+        if (n <= 0) break;
+        size_t end = have + (size_t)n;
+        for (size_t i = 0; i + 3 <= end; i++) {
+            // lines are searched without their newline, so no trigram has one
+            if (buf[i] == '\n' || buf[i + 1] == '\n' || buf[i + 2] == '\n') continue;
+            uint32_t t = trigram_of(buf + i);
+            if (seen[t >> 6] & (1ULL << (t & 63))) continue;
+            seen[t >> 6] |= 1ULL << (t & 63);
+            if (*count == *cap) {
+                *cap = *cap ? *cap * 2 : 1 << 20;
+                *pairs = xrealloc(*pairs, *cap * sizeof(uint64_t));
+            }
+            (*pairs)[(*count)++] = ((uint64_t)t << 32) | file;
+        }
+        have = end < 2 ? end : 2;
+        memmove(buf, buf + end - have, have);
+    }
+    close(fd);
+    for (size_t i = first; i < *count; i++) {
+        uint32_t t = (uint32_t)((*pairs)[i] >> 32);
+        seen[t >> 6] &= ~(1ULL << (t & 63));
+    }
+}
+
+int pair_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// write n bytes to fp, or say why not
+bool write_all(FILE *fp, const void *p, size_t n, const char *path) {
+    if (n == 0 || fwrite(p, 1, n, fp) == n) return true;
+    perror(path);
+    return false;
+}
+
+// the name of segment n of a shard of the index: segment 0 is the base, the rest are updates.
+// Shard 0 has the names of an index that isn't sharded (.ggrep_index, .ggrep_index.1 ...),
+// shard k has .ggrep_index-k, .ggrep_index-k.1 ...
+char *index_segment_name(const char *root, int shard, int n) {
+    char name[sizeof(INDEX_NAME) + 32];
+    int len = snprintf(name, sizeof(name), "%s", INDEX_NAME);
+    if (shard > 0) len += snprintf(name + len, sizeof(name) - (size_t)len, "-%d", shard);
+    if (n > 0) snprintf(name + len, sizeof(name) - (size_t)len, ".%d", n);
+    return path_join(root, name);
+}
+
+// which of shards the file at path (relative to the tree) is in: FNV-1a of the path
+int index_shard_of(const char *path, int shards) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)path; *p; p++) h = (h ^ *p) * 16777619u;
+    return (int)(h % (uint32_t)shards);
+}
+
+// how many shards the index of the tree at root has: as many bases as there are in a row
+int index_shard_count(const char *root) {
+    int shards = 1;
+    while (shards < INDEX_MAX_SHARDS) {
+        char *path = index_segment_name(root, shards, 0);
+        bool exists = access(path, F_OK) == 0;
+        free(path);
+        if (!exists) break;
+        shards++;
+    }
+    return shards;
+}
+
+// the files of tree that are in shard, still in path order. The paths are tree's: free
+// just .files
+TreeList tree_shard(const TreeList *tree, int shard, int shards) {
+    TreeList list = {xmalloc((tree->count ? tree->count : 1) * sizeof(TreeFile)), 0, tree->count};
+    for (size_t i = 0; i < tree->count; i++)
+        if (shards == 1 || index_shard_of(tree->files[i].path, shards) == shard) list.files[list.count++] = tree->files[i];
+    return list;
+}
+
+// a job on one shard of the index of root, for shards_run
+typedef bool (*ShardJob)(const char *root, int shard, int shards, void *arg);
+
+// run job on every shard, each in a process of its own, all at once, and wait for them.
+// Returns false if any of them failed. With one shard (or if fork fails) it runs here
+bool shards_run(const char *root, int shards, ShardJob job, void *arg) {
+    if (shards == 1) return job(root, 0, 1, arg);
+    pid_t pid[INDEX_MAX_SHARDS];
+    bool ok = true;
+    fflush(NULL);
+    for (int k = 0; k < shards; k++) {
+        pid[k] = fork();
+        if (pid[k] == 0) {
+            bool done = job(root, k, shards, arg);
+            fflush(NULL);
+            _exit(done ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        if (pid[k] < 0) {
+            perror("fork");
+            ok &= job(root, k, shards, arg);
+        }
+    }
+    for (int k = 0; k < shards; k++) {
+        if (pid[k] < 0) continue;
+        int status;
+        pid_t w;
+        while ((w = waitpid(pid[k], &status, 0)) < 0 && errno == EINTR) {}
+        if (w < 0) perror("waitpid");
+        ok &= w >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    }
+    return ok;
+}
+
+// an index file being written: the entries first, then each posting list as it's added,
+// then the trigram table and the names. It's written under another name (path.tmp) and
+// renamed when it's done, so a search never sees half of it
+typedef struct {
+    FILE *fp;
+    const char *path;
+    char *tmp;
+    const TreeFile *files;
+    size_t file_count;
+    IndexTrigram *trigrams;
+    size_t trigram_count;
+    size_t trigram_cap;
+    unsigned char *buf;		// the list being encoded
+    size_t buf_cap;
+    uint64_t postings_len;
+    bool ok;
+} IndexWriter;
+
+// start writing the index of files (sorted by path) at path
+bool index_writer_open(IndexWriter *w, const char *path, const TreeFile *files, size_t file_count) {
+    *w = (IndexWriter){.path = path, .files = files, .file_count = file_count};
+    w->tmp = xmalloc(strlen(path) + 5);
+    sprintf(w->tmp, "%s.tmp", path);
+    w->fp = fopen(w->tmp, "wb");
+    w->ok = w->fp != NULL;
+    if (!w->fp) perror(w->tmp);
+
+    // the header is written again at the end, when the offsets are known
+    IndexHeader h = {0};
+    if (w->ok) w->ok = write_all(w->fp, &h, sizeof(h), w->tmp);
+    uint64_t name = 0;
+    for (size_t i = 0; w->ok && i < file_count; i++) {
+        IndexEntry e = files[i].stat;
+        e.name = name;
+        name += strlen(files[i].path) + 1;
+        w->ok = write_all(w->fp, &e, sizeof(e), w->tmp);
+    }
+    return w->ok;
+}
+
+// add the list of a trigram higher than any added so far: files[0..count), ascending
+void index_writer_add(IndexWriter *w, uint32_t trigram, const uint32_t *files, uint32_t count) {
+    if (!w->ok || count == 0) return;
+    if (w->trigram_count == w->trigram_cap) {
+        w->trigram_cap = w->trigram_cap ? w->trigram_cap * 2 : 4096;
+        w->trigrams = xrealloc(w->trigrams, w->trigram_cap * sizeof(IndexTrigram));
+    }
+    w->trigrams[w->trigram_count++] = (IndexTrigram){.trigram = trigram, .count = count, .at = w->postings_len};
+    size_t bound = postings_bound(count);
+    if (bound > w->buf_cap) {
+        w->buf_cap = bound;
+        free(w->buf);
+        w->buf = xmalloc(w->buf_cap);
+    }
+    size_t n = postings_encode(files, count, w->buf);
+    w->ok = write_all(w->fp, w->buf, n, w->tmp);
+    w->postings_len += n;
+}
+
+// write the rest and put the file in place (or remove it if anything failed)
+bool index_writer_close(IndexWriter *w) {
+    IndexHeader h = {.version = INDEX_VERSION};
+    memcpy(h.magic, INDEX_MAGIC, 4);
+    h.file_count = (uint32_t)w->file_count;
+    h.trigram_count = (uint32_t)w->trigram_count;
+    h.entries_at = sizeof(IndexHeader);
+    h.postings_at = h.entries_at + w->file_count * sizeof(IndexEntry);
+    h.trigrams_at = (h.postings_at + w->postings_len + POSTINGS_PAD + 7) / 8 * 8;
+    h.names_at = h.trigrams_at + w->trigram_count * sizeof(IndexTrigram);
+
+    static const char zeros[POSTINGS_PAD + 8];
+    bool ok = w->ok;
+    if (ok) ok = write_all(w->fp, zeros, h.trigrams_at - h.postings_at - w->postings_len, w->tmp);
+    if (ok) ok = write_all(w->fp, w->trigrams, w->trigram_count * sizeof(IndexTrigram), w->tmp);
+    for (size_t i = 0; ok && i < w->file_count; i++)
+        ok = write_all(w->fp, w->files[i].path, strlen(w->files[i].path) + 1, w->tmp);
+    if (ok && fseek(w->fp, 0, SEEK_SET) != 0) {
+        perror(w->tmp);
+        ok = false;
+    }
+    if (ok) ok = write_all(w->fp, &h, sizeof(h), w->tmp);
+    if (w->fp && fclose(w->fp) != 0 && ok) {
+        perror(w->tmp);
+        ok = false;
+    }
+    if (ok && rename(w->tmp, w->path) != 0) {
+        perror(w->path);
+        ok = false;
+    }
+    if (!ok && w->fp) remove(w->tmp);
+    free(w->tmp);
+    free(w->trigrams);
+    free(w->buf);
+    return ok;
+}
+
+// write files (sorted by path) and their trigram pairs (sorted) as the index file path
+bool index_write(const char *path, const TreeFile *files, size_t file_count,
+                 const uint64_t *pairs, size_t count) {
+    IndexWriter w;
+    index_writer_open(&w, path, files, file_count);
+    uint32_t *list = xmalloc((file_count ? file_count : 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < count; ) {
+        uint32_t trigram = (uint32_t)(pairs[i] >> 32);
+        uint32_t n = 0;
+        for (; i < count && pairs[i] >> 32 == trigram; i++) list[n++] = (uint32_t)pairs[i];
+        index_writer_add(&w, trigram, list, n);
+    }
+    free(list);
+    return index_writer_close(&w);
+}
+
+void index_unreadable(const char *path) {
+    fprintf(stderr, "%s: not an index this ggrep can read (build it again)\n", path);
+}
+
+// can the len bytes at map be read as an index without going outside them? The file is in
+// the tree being searched, so anyone could have put anything there: every offset, count and
+// name in it is checked here, and the file numbers in the posting lists as they're decoded
+bool index_check(const char *map, size_t len) {
+    const IndexHeader *h = (const IndexHeader *)(const void *)map;
+    if (memcmp(h->magic, INDEX_MAGIC, 4) != 0 || h->version != INDEX_VERSION) return false;
+
+    // the parts in order, inside the file, aligned for what's in them and big enough for it
+    if (h->entries_at < sizeof(IndexHeader) || h->entries_at > h->postings_at ||
+        h->postings_at > h->trigrams_at || h->trigrams_at > h->names_at || h->names_at > len ||
+        h->entries_at % 8 != 0 || h->trigrams_at % 8 != 0 ||
+        (h->postings_at - h->entries_at) / sizeof(IndexEntry) < h->file_count ||
+        h->trigrams_at - h->postings_at < POSTINGS_PAD ||
+        (h->names_at - h->trigrams_at) / sizeof(IndexTrigram) < h->trigram_count)
+        return false;
+
+    // every name starts inside names, and ends there: the last byte of the file is a NUL
+    const IndexEntry *entries = (const IndexEntry *)(const void *)(map + h->entries_at);
+    size_t names_len = len - h->names_at;
+    if (h->file_count && (names_len == 0 || map[len - 1] != '\0')) return false;
+    for (uint32_t f = 0; f < h->file_count; f++)
+        if (entries[f].name >= names_len) return false;
+
+    // the trigrams in order (lookups and merges count on it), and every posting list inside
+    // postings (the padding after them aside), with no more files than the index has
+    const IndexTrigram *trigrams = (const IndexTrigram *)(const void *)(map + h->trigrams_at);
+    const unsigned char *postings = (const unsigned char *)map + h->postings_at;
+    size_t postings_len = h->trigrams_at - h->postings_at - POSTINGS_PAD;
+    for (uint32_t t = 0; t < h->trigram_count; t++) {
+        const IndexTrigram *tri = &trigrams[t];
+        if ((t > 0 && tri->trigram <= trigrams[t - 1].trigram) ||
+            tri->count > h->file_count || tri->at > postings_len ||
+            postings_size(postings + tri->at, tri->count, postings_len - tri->at) == SIZE_MAX)
+            return false;
+    }
+    return true;
+}
+
+// map the index file at path (ix takes it, for index_close to free) of the tree at root.
+// Returns false (having said why) if there isn't a usable one
+bool index_map(Index *ix, char *path, const char *root) {
+    *ix = (Index){0};
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "%s: no index (make one with ggrep --index build %s)\n", path, root);
+        if (fd >= 0) close(fd);
+        free(path);
+        return false;
+    }
+    size_t len = (size_t)st.st_size;
+    void *map = len >= sizeof(IndexHeader) ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED || !index_check(map, len)) {
+        index_unreadable(path);
+        if (map != MAP_FAILED) munmap(map, len);
+        free(path);
+        return false;
+    }
+    const IndexHeader *h = map;
+    ix->path = path;
+    ix->map = map;
+    ix->map_len = len;
+    ix->header = h;
+    ix->entries = (const IndexEntry *)(ix->map + h->entries_at);
+    ix->trigrams = (const IndexTrigram *)(ix->map + h->trigrams_at);
+    ix->postings = (const unsigned char *)ix->map + h->postings_at;
+    ix->names = ix->map + h->names_at;
+    return true;
+}
+
+// map segment n of a shard of the index of the tree at root
+bool index_open(Index *ix, const char *root, int shard, int n) {
+    return index_map(ix, index_segment_name(root, shard, n), root);
+}
+
+void index_close(Index *ix) {
+    if (ix->map) munmap((void *)ix->map, ix->map_len);
+    free(ix->path);
+    *ix = (Index){0};
+}
+
+// decode the trigram's posting list into dst. A file number the index doesn't have means
+// the file is corrupt: there's no going on from that
+void index_decode(const Index *ix, const IndexTrigram *t, uint32_t *dst) {
+    postings_decode(ix->postings + t->at, t->count, dst);
+    uint32_t bad = 0;
+    for (uint32_t i = 0; i < t->count; i++) bad |= dst[i] >= ix->header->file_count;
+    if (bad) {
+        index_unreadable(ix->path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// the trigram's entry, or NULL if no file has it
+const IndexTrigram *index_lookup(const Index *ix, uint32_t trigram) {
+    size_t lo = 0;
+    size_t hi = ix->header->trigram_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ix->trigrams[mid].trigram < trigram) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < ix->header->trigram_count && ix->trigrams[lo].trigram == trigram ? &ix->trigrams[lo] : NULL;
+}
+
+// the trigram's posting list, decoded (empty if no file has it)
+PostingList index_postings(const Index *ix, uint32_t trigram) {
+    const IndexTrigram *t = index_lookup(ix, trigram);
+    uint32_t count = t ? t->count : 0;
+    PostingList list = {xmalloc((count ? count : 1) * sizeof(uint32_t)), count};
+    if (t) index_decode(ix, t, list.files);
+    return list;
+}
+
+// how many files a part of a query could leave, to do the parts of an AND smallest first
+uint32_t query_estimate(const Index *ix, const Query *q) {
+    if (q->op == Q_NONE) return 0;
+    if (q->op != Q_TRIGRAM) return UINT32_MAX;
+    const IndexTrigram *t = index_lookup(ix, q->trigram);
+    return t ? t->count : 0;
+}
+
+// the files of the index that satisfy q (which isn't Q_ALL: query_join folds those away)
+PostingList query_postings(const Index *ix, const Query *q) {
+    if (q->op == Q_NONE) return (PostingList){xmalloc(sizeof(uint32_t)), 0};
+    if (q->op == Q_TRIGRAM) return index_postings(ix, q->trigram);
+
+    PostingList result;
+    if (q->op == Q_OR) {
+        result = query_postings(ix, q->sub[0]);
+        for (int i = 1; i < q->count; i++) {
+            PostingList part = query_postings(ix, q->sub[i]);
+            PostingList both = postings_union(result, part);
+            free(result.files);
+            free(part.files);
+            result = both;
+        }
+        return result;
+    }
+
+    // AND: the shortest lists first, so the rest are galloped through, and none at all once
+    // nothing is left
+    int *order = xmalloc((size_t)q->count * sizeof(int));
+    uint32_t *estimate = xmalloc((size_t)q->count * sizeof(uint32_t));
+    for (int i = 0; i < q->count; i++) {
+        estimate[i] = query_estimate(ix, q->sub[i]);
+        int k = i;
+        for (; k > 0 && estimate[order[k - 1]] > estimate[i]; k--) order[k] = order[k - 1];
+        order[k] = i;
+    }
+    result = query_postings(ix, q->sub[order[0]]);
+    for (int i = 1; i < q->count && result.count; i++) {
+        PostingList part = query_postings(ix, q->sub[order[i]]);
+        PostingList both = postings_intersect(result, part);
+        free(result.files);
+        free(part.files);
+        result = both;
+    }
+    free(order);
+    free(estimate);
+    return result;
+}
+
+// which indexed files could match the query (see Trigram Query Planner): cand has a byte per
+// file, set if it has to be searched
+void index_candidates(const Index *ix, const Query *q, unsigned char *cand) {
+    uint32_t files = ix->header->file_count;
+    if (q->op == Q_ALL) {
+        memset(cand, 1, files);
+        return;
+    }
+    memset(cand, 0, files);
+    PostingList list = query_postings(ix, q);
+    for (uint32_t i = 0; i < list.count; i++) cand[list.files[i]] = 1;
+    free(list.files);
+}
+
+// the base index of a tree and the update segments written since (see index_update)
+typedef struct {
+    Index seg[INDEX_MAX_SEGMENTS];
+    int count;
+} IndexSet;
+
+// open all the segments of a shard of the index of the tree at root (or say why not)
+bool index_set_open(IndexSet *set, const char *root, int shard) {
+    set->count = 0;
+    if (!index_open(&set->seg[0], root, shard, 0)) return false;
+    set->count = 1;
+    while (set->count < INDEX_MAX_SEGMENTS) {
+        char *path = index_segment_name(root, shard, set->count);
+        bool exists = access(path, F_OK) == 0;
+        free(path);
+        if (!exists || !index_open(&set->seg[set->count], root, shard, set->count)) break;
+        set->count++;
+    }
+    return true;
+}
+
+void index_set_close(IndexSet *set) {
+    for (int i = 0; i < set->count; i++) index_close(&set->seg[i]);
+    set->count = 0;
+}
+
+// find the newest entry for path: returns its segment (and the entry in *entry), or -1 if no
+// segment has it. Paths have to be asked for in order: cursor (a position in each segment,
+// starting at 0) moves through the sorted entries as they are
+int index_set_find(const IndexSet *set, uint32_t *cursor, const char *path, uint32_t *entry) {
+    int found = -1;
+    for (int s = 0; s < set->count; s++) {
+        const Index *ix = &set->seg[s];
+        uint32_t files = ix->header->file_count;
+        while (cursor[s] < files && strcmp(ix->names + ix->entries[cursor[s]].name, path) < 0) cursor[s]++;
+        if (cursor[s] < files && strcmp(ix->names + ix->entries[cursor[s]].name, path) == 0) {
+            found = s;
+            *entry = cursor[s];
+        }
+    }
+    return found;
+}
+
+// has the file changed since e was made of it?
+bool index_entry_stale(const IndexEntry *e, const IndexEntry *now) {
+    return e->size != now->size || e->mtime_sec != now->mtime_sec ||
+           e->mtime_nsec != now->mtime_nsec || e->inode != now->inode;
+}
+
+// remove segments from to count - 1 of a shard (from 1: the base has just been rewritten)
+void index_remove_segments(const char *root, int shard, int from, int count) {
+    for (int n = from; n < count; n++) {
+        char *path = index_segment_name(root, shard, n);
+        if (remove(path) != 0 && errno != ENOENT) perror(path);
+        free(path);
+    }
+}
+
+int uint32_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// write segs[0..n) as one index at path. files is the merged file list (sorted by path), and
+// renumber[s] gives each file of segment s its number in it (UINT32_MAX: left out). The
+// trigram tables are walked in step, so each trigram's list is put together from the
+// segments' lists and written before the next: only one list is in memory at a time
+bool index_write_merged(const char *path, const TreeFile *files, size_t file_count,
+                        const Index *segs, int n, uint32_t *const *renumber) {
+    IndexWriter w;
+    index_writer_open(&w, path, files, file_count);
+    uint32_t *next = xcalloc((size_t)n, sizeof(uint32_t));	// place in each trigram table
+    uint32_t most = 1;
+    for (int s = 0; s < n; s++)
+        if (segs[s].header->file_count > most) most = segs[s].header->file_count;
+    uint32_t *decoded = xmalloc(most * sizeof(uint32_t));
+    // a file is only taken from one segment, so the list has at most file_count
+    uint32_t *list = xmalloc((file_count ? file_count : 1) * sizeof(uint32_t));
+
+    for (;;) {
+        uint32_t trigram = UINT32_MAX;
+        for (int s = 0; s < n; s++)
+            if (next[s] < segs[s].header->trigram_count && segs[s].trigrams[next[s]].trigram < trigram)
+                trigram = segs[s].trigrams[next[s]].trigram;
+        if (trigram == UINT32_MAX) break;
+
+        uint32_t count = 0;
+        bool sorted = true;		// the segments' lists only need sorting if they interleave
+        for (int s = 0; s < n; s++) {
+            if (next[s] >= segs[s].header->trigram_count) continue;
+            const IndexTrigram *tri = &segs[s].trigrams[next[s]];
+            if (tri->trigram != trigram) continue;
+            next[s]++;
+            index_decode(&segs[s], tri, decoded);
+            for (uint32_t k = 0; k < tri->count; k++) {
+                uint32_t file = renumber[s][decoded[k]];
+                if (file == UINT32_MAX) continue;
+                if (count > 0 && file < list[count - 1]) sorted = false;
+                list[count++] = file;
+            }
+        }
+        if (!sorted) qsort(list, count, sizeof(uint32_t), uint32_cmp);
+        index_writer_add(&w, trigram, list, count);
+    }
+    free(list);
+    free(decoded);
+    free(next);
+    return index_writer_close(&w);
+}
+
+// index files[0..count) (sorted by path) as the file at path. Their trigrams are collected
+// INDEX_BATCH_PAIRS at a time: if they don't all fit, each batch is written as a part of
+// its own (path.part0 ...), and the parts are merged
+bool index_write_files(const char *root, const char *path, const TreeFile *files, size_t count) {
+    uint64_t *seen = xcalloc(TRIGRAMS / 64, sizeof(uint64_t));
+    uint64_t *pairs = NULL;
+    size_t pair_count = 0;
+    size_t cap = 0;
+    size_t *first = xmalloc((count + 1) * sizeof(size_t));	// the first file of each part
+    int parts = 0;
+    bool ok = true;
+    char *part_path = xmalloc(strlen(path) + 32);
+
+    first[0] = 0;
+    for (size_t i = 0; ok && i < count; i++) {
+        char *full = path_join(root, files[i].path);
+        index_file_trigrams(full, (uint32_t)(i - first[parts]), seen, &pairs, &pair_count, &cap);
+        free(full);
+        bool last = i + 1 == count;
+        if (!last && pair_count < INDEX_BATCH_PAIRS) continue;
+
+        if (pair_count) qsort(pairs, pair_count, sizeof(uint64_t), pair_cmp);
+        const TreeFile *batch = files + first[parts];
+        size_t batch_count = i + 1 - first[parts];
+        if (last && parts == 0) {
+            ok = index_write(path, batch, batch_count, pairs, pair_count);
+        } else {
+            sprintf(part_path, "%s.part%d", path, parts);
+            ok = index_write(part_path, batch, batch_count, pairs, pair_count);
+            first[++parts] = i + 1;
+        }
+        pair_count = 0;
+    }
+    free(pairs);
+    free(seen);
+    if (count == 0) ok = index_write(path, files, 0, NULL, 0);
+
+    // the parts are whole runs of the files, in order: renumbering them is adding where each
+    // run starts
+    if (ok && parts > 0) {
+        Index *segs = xcalloc((size_t)parts, sizeof(Index));
+        uint32_t **renumber = xcalloc((size_t)parts, sizeof(uint32_t *));
+        for (int p = 0; ok && p < parts; p++) {
+            sprintf(part_path, "%s.part%d", path, p);
+            char *name = xmalloc(strlen(part_path) + 1);
+            strcpy(name, part_path);
+            ok = index_map(&segs[p], name, root);
+            size_t n = first[p + 1] - first[p];
+            renumber[p] = xmalloc((n ? n : 1) * sizeof(uint32_t));
+            for (size_t k = 0; k < n; k++) renumber[p][k] = (uint32_t)(first[p] + k);
+        }
+        if (ok) ok = index_write_merged(path, files, count, segs, parts, renumber);
+        for (int p = 0; p < parts; p++) {
+            index_close(&segs[p]);
+            free(renumber[p]);
+        }
+        free(segs);
+        free(renumber);
+    }
+    for (int p = 0; p < parts; p++) {
+        sprintf(part_path, "%s.part%d", path, p);
+        if (remove(part_path) != 0 && errno != ENOENT) perror(part_path);
+    }
+    free(part_path);
+    free(first);
+    return ok;
+}
+
+// +++++++++++
+// Handle --index: 1of3: build DIR/.ggrep_index (and its other shards) from every file,
+// replacing any update segments
+// +++++++++++
+// build the base of one shard from its files (arg: the whole tree)
+bool index_build_shard(const char *root, int shard, int shards, void *arg) {
+    TreeList list = tree_shard(arg, shard, shards);
+    char *path = index_segment_name(root, shard, 0);
+    bool ok = index_write_files(root, path, list.files, list.count);
+    if (ok) {
+        index_remove_segments(root, shard, 1, INDEX_MAX_SEGMENTS);
+        fprintf(stderr, "Indexed %zu files: %s\n", list.count, path);
+    }
+    free(path);
+    free(list.files);
+    return ok;
+}
+
+bool index_build(const char *root, int shards) {
+    int old_shards = index_shard_count(root);
+    TreeList tree = tree_list(root);
+    bool ok = shards_run(root, shards, index_build_shard, &tree);
+    // the shards of an index built with more of them are no longer part of it
+    for (int k = shards; ok && k < old_shards; k++) index_remove_segments(root, k, 0, INDEX_MAX_SEGMENTS);
+    tree_free(&tree);
+    return ok;
+}
+
+// +++++++++++
+// Handle --index: 2of3: merge the update segments into the base index. Only what the index
+// already has is used (no file is read): the newest entry for each file still in the tree,
+// and its postings renumbered. Files that changed since their entry was made are left out,
+// to be searched every time until the next update
+// +++++++++++
+// merge the segments of one shard (arg: the whole tree)
+bool index_merge_shard(const char *root, int shard, int shards, void *arg) {
+    IndexSet set;
+    if (!index_set_open(&set, root, shard)) return false;
+    TreeList tree = tree_shard(arg, shard, shards);
+
+    // the merged file list, and for each segment its file numbers in it (UINT32_MAX: dropped)
+    TreeFile *files = xmalloc((tree.count ? tree.count : 1) * sizeof(TreeFile));
+    size_t file_count = 0;
+    uint32_t *renumber[INDEX_MAX_SEGMENTS] = {0};
+    uint32_t cursor[INDEX_MAX_SEGMENTS] = {0};
+    for (int s = 0; s < set.count; s++) {
+        uint32_t n = set.seg[s].header->file_count;
+        renumber[s] = xmalloc((n ? n : 1) * sizeof(uint32_t));
+        for (uint32_t i = 0; i < n; i++) renumber[s][i] = UINT32_MAX;
+    }
+    for (size_t i = 0; i < tree.count; i++) {
+        uint32_t entry;
+        int s = index_set_find(&set, cursor, tree.files[i].path, &entry);
+        if (s < 0 || index_entry_stale(&set.seg[s].entries[entry], &tree.files[i].stat)) continue;
+        renumber[s][entry] = (uint32_t)file_count;
+        files[file_count].path = tree.files[i].path;
+        files[file_count].stat = set.seg[s].entries[entry];
+        file_count++;
+    }
+
+    // the new base replaces the old one by a rename, so the old one can be read till then
+    int segments = set.count;
+    char *path = index_segment_name(root, shard, 0);
+    bool ok = index_write_merged(path, files, file_count, set.seg, set.count, renumber);
+    index_set_close(&set);
+    if (ok) {
+        index_remove_segments(root, shard, 1, segments);
+        fprintf(stderr, "Merged %d segments: %zu files: %s\n", segments, file_count, path);
+    }
+    free(path);
+    for (int s = 0; s < segments; s++) free(renumber[s]);
+    free(files);
+    free(tree.files);
+    return ok;
+}
+
+bool index_merge(const char *root) {
+    TreeList tree = tree_list(root);
+    bool ok = shards_run(root, index_shard_count(root), index_merge_shard, &tree);
+    tree_free(&tree);
+    return ok;
+}
+
+// +++++++++++
+// Handle --index: 3of3: bring the index up to date: compare each file's size, mtime and inode
+// with its newest entry, and index just the new and changed ones, in a new segment. When
+// there are INDEX_MAX_SEGMENTS the segments are merged. Deleted files need nothing: a
+// search only looks up files it finds in the tree
+// +++++++++++
+// update one shard (arg: the whole tree)
+bool index_update_shard(const char *root, int shard, int shards, void *arg) {
+    IndexSet set;
+    if (!index_set_open(&set, root, shard)) return false;
+
+    TreeList tree = tree_shard(arg, shard, shards);
+    TreeFile *changed = xmalloc((tree.count ? tree.count : 1) * sizeof(TreeFile));
+    size_t changed_count = 0;
+    uint64_t changed_bytes = 0;
+    uint32_t cursor[INDEX_MAX_SEGMENTS] = {0};
+    for (size_t i = 0; i < tree.count; i++) {
+        uint32_t entry;
+        int s = index_set_find(&set, cursor, tree.files[i].path, &entry);
+        if (s >= 0 && !index_entry_stale(&set.seg[s].entries[entry], &tree.files[i].stat)) continue;
+        changed[changed_count++] = tree.files[i];
+        changed_bytes += tree.files[i].stat.size;
+    }
+    int segment = set.count;
+    index_set_close(&set);
+
+    bool ok = true;
+    if (changed_count == 0) {
+        char *path = index_segment_name(root, shard, 0);
+        fprintf(stderr, "Index is up to date: %s\n", path);
+        free(path);
+    } else {
+        char *path = index_segment_name(root, shard, segment);
+        ok = index_write_files(root, path, changed, changed_count);
+        if (ok) fprintf(stderr, "Indexed %zu changed files (%llu bytes): %s\n", changed_count,
+                        (unsigned long long)changed_bytes, path);
+        free(path);
+        if (ok && segment + 1 >= INDEX_MAX_SEGMENTS) ok = index_merge_shard(root, shard, shards, arg);
+    }
+    free(changed);
+    free(tree.files);
+    return ok;
+}
+
+// an index that isn't there yet is built (in one shard)
+bool index_update(const char *root) {
+    char *base = index_segment_name(root, 0, 0);
+    bool have_base = access(base, F_OK) == 0;
+    free(base);
+    if (!have_base) return index_build(root, 1);
+    TreeList tree = tree_list(root);
+    bool ok = shards_run(root, index_shard_count(root), index_update_shard, &tree);
+    tree_free(&tree);
+    return ok;
+}
+
+// +++++++++++
+// Handle --index DIR: search the tree at root, reading only the files the index can't rule
+// out (and any that changed since they were indexed). With shards, each shard's files are
+// searched by a process of its own into a file of its own, and the files' output is then
+// copied out in path order
+// +++++++++++
+// what one process's search found, for --explain and --stats
+typedef struct {
+    size_t searched;	// files read: candidates, and files the index is out of date for
+    size_t changed;		// files not in the index or changed since
+    MemBudget mem;
+} ShardReport;
+
+typedef struct {
+    const Options *opts;
+    const regex_t *regex;
+    const Query *query;
+    const TreeList *tree;
+    bool parallel;				// a process per shard, each writing to out_fd[shard]
+    int out_fd[INDEX_MAX_SHARDS];
+    off_t *out_end;				// (shared) where each tree file's output ends in its shard's file
+    ShardReport *report;		// (shared) one per shard
+} ShardSearch;
+
+// search the files of the tree in shard, or in every shard if shard is -1 (arg: ShardSearch)
+bool index_search_shard(const char *root, int shard, int shards, void *arg) {
+    ShardSearch *search = arg;
+    const Options *opts = search->opts;
+    const regex_t *regex = search->regex;
+    const TreeList *tree = search->tree;
+    int first = shard < 0 ? 0 : shard;
+    int last = shard < 0 ? shards - 1 : shard;
+    IndexSet *sets = xcalloc((size_t)shards, sizeof(IndexSet));
+    unsigned char *cand[INDEX_MAX_SHARDS][INDEX_MAX_SEGMENTS];
+    bool ok = true;
+    for (int k = first; k <= last && ok; k++) {
+        ok = index_set_open(&sets[k], root, k);
+        for (int s = 0; s < sets[k].count; s++) {
+            uint32_t files = sets[k].seg[s].header->file_count;
+            cand[k][s] = xmalloc(files ? files : 1);
+            index_candidates(&sets[k].seg[s], search->query, cand[k][s]);
+        }
+    }
+    OutBuf saved_out = out;
+    size_t saved_limit = mem.limit;
+    if (ok && search->parallel) {
+        // this process writes to a file of its own, and has its share of --max-memory
+        out_init(search->out_fd[shard], opts->line_buffered, opts->flush_ms);
+        if (mem.limit) mem.limit = mem.limit / (size_t)shards > MEM_MIN ? mem.limit / (size_t)shards : MEM_MIN;
+    }
+
+    // the files ruled out still have output of their own with -c (a 0 count) or -F (the
+    // title), and --format=binary numbers every file: search them as empty files
+    bool empty_output = opts->count_only || opts->filename_title || opts->format == FORMAT_BINARY;
+    FILE *empty = ok && empty_output ? fopen("/dev/null", "r") : NULL;
+
+    QueuedFile *queue = xmalloc((tree->count ? tree->count : 1) * sizeof(QueuedFile));
+    int queued = 0;
+    uint32_t cursor[INDEX_MAX_SHARDS][INDEX_MAX_SEGMENTS] = {{0}};
+    ShardReport *report = &search->report[first];
+    for (size_t i = 0; i < tree->count && ok; i++) {
+        const TreeFile *tf = &tree->files[i];
+        int k = shards == 1 ? 0 : index_shard_of(tf->path, shards);
+        if (k < first || k > last) continue;
+        uint32_t entry;
+        int s = index_set_find(&sets[k], cursor[k], tf->path, &entry);
+        char *full = path_join(root, tf->path);
+        bool stale = s < 0 || index_entry_stale(&sets[k].seg[s].entries[entry], &tf->stat);
+        report->changed += stale;
+        if (stale || cand[k][s][entry]) {
+            queue[queued].path = full;
+            queue[queued].hot = false;
+            queued++;
+            if (!opts->hot_first) search_path(full, opts, regex);
+        } else {
+            if (empty) {
+                rewind(empty);
+                process_file(empty, full, opts, regex);
+            }
+            free(full);
+        }
+        if (search->parallel) {
+            out_flush();
+            search->out_end[i] = lseek(out.fd, 0, SEEK_CUR);
+        }
+    }
+    if (opts->hot_first) search_hot_first(queue, queued, opts, regex);
+    out_flush();
+    report->searched = (size_t)queued;
+    report->mem = mem;
+    if (ok && search->parallel) {
+        // as it was (this only matters if fork failed and the shard was searched here)
+        big_free(out.buf, out.cap);
+        out = saved_out;
+        mem.limit = saved_limit;
+    }
+
+    for (int i = 0; i < queued; i++) free(queue[i].path);
+    free(queue);
+    if (empty) fclose(empty);
+    for (int k = first; k <= last; k++) {
+        for (int s = 0; s < sets[k].count; s++) free(cand[k][s]);
+        index_set_close(&sets[k]);
+    }
+    free(sets);
+    return ok;
+}
+
+bool index_search(const char *root, const Options *opts, const regex_t *regex) {
+    int shards = index_shard_count(root);
+    Query *query = plan_query(opts);
+    TreeList tree = tree_list(root);
+    ShardSearch search = {.opts = opts, .regex = regex, .query = query, .tree = &tree};
+
+    // a process per shard, unless there's one, or the output can't be put back together: --hot-first
+    // searches in an order of its own, and --format=binary numbers the files as it goes. Nor
+    // with --line-buffered or --flush-ms: the output of a shard only comes out once it's done
+    search.parallel = shards > 1 && !opts->hot_first && opts->format != FORMAT_BINARY &&
+                      !opts->line_buffered && opts->flush_ms < 0;
+    size_t shared_len = (size_t)shards * sizeof(ShardReport) + (tree.count + 1) * sizeof(off_t);
+    char *shared = mmap(NULL, shared_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    search.report = (ShardReport *)(void *)shared;
+    search.out_end = (off_t *)(void *)(shared + (size_t)shards * sizeof(ShardReport));
+    for (int k = 0; search.parallel && k < shards; k++) {
+        FILE *tmp = tmpfile();
+        if (!tmp) {
+            perror("tmpfile");
+            exit(EXIT_FAILURE);
+        }
+        search.out_fd[k] = dup(fileno(tmp));
+        fclose(tmp);
+    }
+
+    bool ok;
+    if (search.parallel) {
+        out_flush();
+        ok = shards_run(root, shards, index_search_shard, &search);
+        // each file's output, in path order, from the file of its shard
+        off_t from[INDEX_MAX_SHARDS] = {0};
+        for (size_t i = 0; ok && i < tree.count; i++) {
+            int k = index_shard_of(tree.files[i].path, shards);
+            size_t n = (size_t)(search.out_end[i] - from[k]);
+            size_t done = n >= ZERO_COPY_MIN ? out_kernel_copy(search.out_fd[k], from[k], n) : 0;
+            if (done < n) out_copy_from_fd(search.out_fd[k], from[k] + (off_t)done, n - done);
+            from[k] = search.out_end[i];
+        }
+        for (int k = 0; k < shards; k++) close(search.out_fd[k]);
+    } else {
+        ok = index_search_shard(root, -1, shards, &search);
+    }
+
+    // the other processes' allocations and input count too. Their peaks are added: they
+    // were all running at once
+    size_t searched = 0;
+    size_t changed = 0;
+    for (int k = 0; k < shards; k++) {
+        const ShardReport *r = &search.report[k];
+        searched += r->searched;
+        changed += r->changed;
+        if (!search.parallel) continue;
+        mem.peak += r->mem.peak;
+        mem.allocs += r->mem.allocs;
+        mem.input += r->mem.input;
+        mem.copied += r->mem.copied;
+        mem.lost += r->mem.lost;
+    }
+
+    // +++++++++++
+    // Handle --explain: what the index was asked, and what it saved
+    // +++++++++++
+    if (ok && opts->explain) {
+        fprintf(stderr, "Query: ");
+        query_print(stderr, query, true);
+        fprintf(stderr, "%s\nSearched %zu of %zu files (%zu not in the index or changed since)",
+                query->op == Q_ALL ? " (no trigrams to look for: every file is searched)" : "",
+                searched, tree.count, changed);
+        if (shards > 1) fprintf(stderr, ", in %d shards%s", shards, search.parallel ? " at once" : "");
+        fprintf(stderr, "\n");
+    }
+
+    munmap(shared, shared_len);
+    tree_free(&tree);
+    query_free(query);
+    return ok;
+}
+
+// +++++++++++
+// Handle --index bench DIR: time decoding every posting list of the index (all shards and
+// segments), with the vector decoder and the scalar one, against copying the same lists
+// out of plain uint32_t arrays. The best of
+// BENCH_ROUNDS rounds of each is reported, per file in the lists
+// +++++++++++
+#define BENCH_ROUNDS 5
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+typedef enum { BENCH_VECTOR, BENCH_SCALAR, BENCH_RAW } BenchWay;
+
+// one pass over every list of every segment, the BenchWay way. Returns the time taken in ns;
+// *check gets a sum of the last file of each list, so the work can't be left out
+long long bench_pass(const IndexSet *sets, int shards, BenchWay way, const uint32_t *raw,
+                     uint32_t *dst, uint64_t *check) {
+    long long start = now_ns();
+    const uint32_t *from = raw;
+    uint64_t sum = 0;
+    for (int k = 0; k < shards; k++) {
+        for (int s = 0; s < sets[k].count; s++) {
+            const Index *ix = &sets[k].seg[s];
+            for (uint32_t t = 0; t < ix->header->trigram_count; t++) {
+                const IndexTrigram *tri = &ix->trigrams[t];
+                const unsigned char *in = ix->postings + tri->at;
+                if (way == BENCH_VECTOR) postings_decode(in, tri->count, dst);
+                else if (way == BENCH_SCALAR) postings_decode_tail(in, in + (tri->count + 3) / 4, tri->count, 0, dst);
+                else memcpy(dst, from, tri->count * sizeof(uint32_t));
+                from += tri->count;
+                sum += dst[tri->count - 1];
+            }
+        }
+    }
+    *check = sum;
+    return now_ns() - start;
+}
+
+bool index_bench(const char *root) {
+    int shards = index_shard_count(root);
+    IndexSet *sets = xcalloc((size_t)shards, sizeof(IndexSet));
+    bool ok = true;
+    for (int k = 0; ok && k < shards; k++) ok = index_set_open(&sets[k], root, k);
+
+    // the lists as plain arrays, one after another, and room for the longest
+    uint64_t lists = 0, files = 0, bytes = 0;
+    uint32_t longest = 1;
+    for (int k = 0; ok && k < shards; k++) {
+        for (int s = 0; s < sets[k].count; s++) {
+            const IndexHeader *h = sets[k].seg[s].header;
+            lists += h->trigram_count;
+            bytes += h->trigrams_at - h->postings_at;
+            for (uint32_t t = 0; t < h->trigram_count; t++) {
+                uint32_t n = sets[k].seg[s].trigrams[t].count;
+                files += n;
+                if (n > longest) longest = n;
+            }
+        }
+    }
+    uint32_t *raw = ok ? xmalloc((files ? files : 1) * sizeof(uint32_t)) : NULL;
+    uint32_t *dst = ok ? xmalloc(longest * sizeof(uint32_t)) : NULL;
+    uint32_t *to = raw;
+    for (int k = 0; ok && k < shards; k++) {
+        for (int s = 0; s < sets[k].count; s++) {
+            const Index *ix = &sets[k].seg[s];
+            for (uint32_t t = 0; t < ix->header->trigram_count; t++) {
+                index_decode(ix, &ix->trigrams[t], to);
+                to += ix->trigrams[t].count;
+            }
+        }
+    }
+
+    if (ok && files > 0) {
+        static const char *const names[] = {
+#if defined(__SSE2__)
+            "decode (SSSE3)",
+#elif defined(__aarch64__)
+            "decode (NEON)",
+#else
+            "decode",
+#endif
+            "decode (scalar)", "copy uint32_t"};
+        printf("%d shards: %llu lists of %llu files: %.1f MB compressed, %.1f MB as uint32_t (%.2fx)\n",
+               shards, (unsigned long long)lists, (unsigned long long)files, (double)bytes / 1e6,
+               (double)files * 4 / 1e6, (double)files * 4 / (double)(bytes ? bytes : 1));
+        uint64_t expect = 0;
+        for (int way = BENCH_VECTOR; way <= BENCH_RAW; way++) {
+            long long best = 0;
+            for (int r = 0; r < BENCH_ROUNDS; r++) {
+                uint64_t check;
+                long long ns = bench_pass(sets, shards, (BenchWay)way, raw, dst, &check);
+                if (way == BENCH_VECTOR && r == 0) expect = check;
+                if (check != expect) {
+                    fprintf(stderr, "%s: the lists came out different\n", names[way]);
+                    ok = false;
+                }
+                if (r == 0 || ns < best) best = ns;
+            }
+            printf("  %-16s %6.3f ns/file  %7.1f ms\n", names[way], (double)best / (double)files, (double)best / 1e6);
+        }
+    }
+    free(raw);
+    free(dst);
+    for (int k = 0; k < shards; k++) index_set_close(&sets[k]);
+    free(sets);
+    return ok;
+}
+
+// -----------------------------------------------------
+// ------------------ Main ------------------
+// -----------------------------------------------------
+int main(int argc, char *argv[]) {
+    Options opts; // this is our full options list if values
+    int first_file_index;	
+    regex_t regex;
+	int regex_compiled = 0; // flag to know if we need to free
    
     // Parse the options including the search pattern. The updated first_file_index
     // gives the location on the command line of the first filename / file wildcard
@@ -466,6 +5168,31 @@ int main(int argc, char *argv[]) {
 		return EXIT_SUCCESS;
 	}
 
+// +++++++++++
+// Handle --with-lines: it's part of --format=binary
+// +++++++++++
+	if (opts.with_lines && opts.format != FORMAT_BINARY) {
+		fprintf(stderr, "Error: --with-lines is only for --format=binary.\n");
+		return EXIT_FAILURE;
+	}
+
+// +++++++++++
+// Handle --index: build, update or merge the index, and that's all
+// +++++++++++
+	// the other modes use as many shards as the index was built with
+	if (opts.shards && opts.index_mode != INDEX_BUILD) {
+		fprintf(stderr, "Error: --shards is only for --index build; the index keeps the shards it was built with.\n");
+		return EXIT_FAILURE;
+	}
+	if (opts.index_mode == INDEX_BUILD)
+		return index_build(opts.index_dir, opts.shards ? opts.shards : 1) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (opts.index_mode == INDEX_UPDATE)
+		return index_update(opts.index_dir) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (opts.index_mode == INDEX_MERGE)
+		return index_merge(opts.index_dir) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (opts.index_mode == INDEX_BENCH)
+		return index_bench(opts.index_dir) ? EXIT_SUCCESS : EXIT_FAILURE;
+
 // +++++++++++
 // Handle invalid number of arguments
 // +++++++++++
@@ -479,25 +5206,42 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+// the pattern and its search tables (-E does its own -i folding, in regcomp and the DFA)
+opts.pattern = pattern_build(opts.pattern_arg, opts.hex_pattern, opts.ignore_case && !opts.use_regex);
+
 // +++++++++++
-// Handle -i: 1of3: make the pattern lower case (unless regex specified)
+// Handle --huge-pages: the allocator has to know before the DFA and the buffers are made
 // +++++++++++
-if (opts.ignore_case && !opts.use_regex) {
-    for (char *p = opts.pattern; *p; p++) {
-        *p = (char)tolower((unsigned char)*p);
-    }
+huge_pages = opts.huge_pages;
+
+// +++++++++++
+// Handle --max-memory: 1of2: set the budget before anything is charged to it
+// +++++++++++
+if (opts.max_memory > 0 && opts.max_memory < MEM_MIN) {
+    fprintf(stderr, "--max-memory must be at least %dK (the fixed buffers need that much)\n", MEM_MIN / 1024);
+    exit(EXIT_FAILURE);
 }
+mem.limit = opts.max_memory;
 
 // +++++++++++
-// Handle -E: 1of2: compile regex 
+// Handle -E: 1of3: compile regex, and for the DFA too if it can do the pattern
 // +++++++++++
 // Handle -i: 2of3: specify REG_ICASE if -i
 // +++++++++++
 if (opts.use_regex) {
-    int flags = REG_NOSUB;  // we don’t need match offsets
+// +++++++++++
+// Handle -x: 2of2: a regex is a C string, so it can't have a NUL in it
+// +++++++++++
+    if (memchr(opts.pattern->bytes, '\0', opts.pattern->len)) {
+        fprintf(stderr, "Regex compilation failed: -E patterns can't contain NUL bytes\n");
+        exit(EXIT_FAILURE);
+    }
+    int flags = 0;
+    // we only need match offsets to highlight or report them
+    if (!spans_wanted(&opts)) flags |= REG_NOSUB;
     if (opts.ignore_case) flags |= REG_ICASE;
 
-    int ret = regcomp(&regex, opts.pattern, flags);
+    int ret = regcomp(&regex, opts.pattern->bytes, flags);
     if (ret != 0) {
         char errbuf[256];
         regerror(ret, &regex, errbuf, sizeof(errbuf));
@@ -505,6 +5249,11 @@ if (opts.use_regex) {
         exit(EXIT_FAILURE);
     }
     regex_compiled = 1;
+    // the DFA cache gets what --max-memory leaves after the fixed buffers, which come later
+    // (the smallest cache if that's nothing: a limit of 0 would be none)
+    if (mem.limit) mem.limit = mem.limit > MEM_MIN ? mem.limit - MEM_MIN : 1;
+    opts.stream = sre_compile(opts.pattern->bytes, opts.ignore_case);
+    mem.limit = opts.max_memory;
 }
 
 // +++++++++++
@@ -514,7 +5263,17 @@ if (opts.filename_only) opts.before = 0;
 
 
 	// ---------------- MAIN PROCESS LOGIC --------------
-	if (first_file_index >= argc) {
+	out_init(STDOUT_FILENO, opts.line_buffered, opts.flush_ms);
+	if (opts.format == FORMAT_BINARY) out_bin_header(&opts);
+
+	if (opts.index_mode == INDEX_SEARCH) {
+		// the index says which files are searched
+		if (first_file_index < argc) {
+			fprintf(stderr, "Error: --index searches the files under %s; don't name any others.\n", opts.index_dir);
+			return EXIT_FAILURE;
+		}
+		if (!index_search(opts.index_dir, &opts, opts.use_regex ? &regex : NULL)) return EXIT_FAILURE;
+	} else if (first_file_index >= argc) {
         // No files specified on the command line; check if stdin has been used to pipe data in
 		if (isatty(fileno(stdin))) {
 			// stdin is a terminal → no pipe or redirection
@@ -525,38 +5284,59 @@ if (opts.filename_only) opts.before = 0;
         process_file(stdin, "<stdin>", &opts, opts.use_regex ? &regex : NULL);
     } else {
 		// process each command line file or file wildcard
+		// --hot-first: just collect them (wildcards expanded) to search in an order of its own
+		QueuedFile *queue = NULL;
+		int queued = 0;
+		int queue_cap = 0;
 		for (int i = first_file_index; i < argc; i++) {
 			glob_t globbuf; // holds array of matching files if there's a wildcard
 			// glob will return = 0 if there's a wildcard that actually matches files
 			// it will return non-0 if there's a single file (no wildcard) or the wildcard doesn't match any files
-			if (glob(argv[i], 0, NULL, &globbuf) == 0) {
-				// so we only get here if there's a wildcard (file?.c or *.h etc) and this actually matches files
-				// if so, process them and then free the glob array
-				for (size_t j = 0; j < globbuf.gl_pathc; j++) {
-					FILE *fp = fopen(globbuf.gl_pathv[j], "r");
-					if (!fp) {
-						perror(globbuf.gl_pathv[j]);
-						continue;   // print error but continue
-					}
-					process_file(fp, globbuf.gl_pathv[j], &opts, opts.use_regex ? &regex : NULL);
-					fclose(fp);
+			bool globbed = glob(argv[i], 0, NULL, &globbuf) == 0;
+			// the paths to search are the glob's matches if there were any, or else the
+			// argument as it is (a file that isn't a wildcard, or a wildcard that matched
+			// nothing: search_path rejects what it can't find). Either way each one is
+			// searched now, or queued for --hot-first
+			size_t npaths = globbed ? globbuf.gl_pathc : 1;
+			for (size_t j = 0; j < npaths; j++) {
+				const char *path = globbed ? globbuf.gl_pathv[j] : argv[i];
+				if (!opts.hot_first) {
+					search_path(path, &opts, opts.use_regex ? &regex : NULL);
+					continue;
 				}
-				globfree(&globbuf);
-			} else {
-				// we only get here if the file was not a wildcard, or was a wildcard that didn't match 
-				// any files. either way, the process_file func will simply reject what it can't find 
-				FILE *fp = fopen(argv[i], "r");
-				if (!fp) {
-					perror(argv[i]);
-					continue;   // print error but continue
+				if (queued == queue_cap) {
+					queue_cap = queue_cap ? queue_cap * 2 : 64;
+					queue = xrealloc(queue, (size_t)queue_cap * sizeof(QueuedFile));
 				}
-				process_file(fp, argv[i], &opts, opts.use_regex ? &regex : NULL);
-				fclose(fp);
+				queue[queued].path = xmalloc(strlen(path) + 1);
+				strcpy(queue[queued].path, path);
+				queued++;
 			}
+			if (globbed) globfree(&globbuf);
 		}
+		if (opts.hot_first) search_hot_first(queue, queued, &opts, opts.use_regex ? &regex : NULL);
+		for (int i = 0; i < queued; i++) free(queue[i].path);
+		free(queue);
     }
+out_flush();
+
+// +++++++++++
+// Handle --max-memory: 2of2: --stats says how much was used at most, and how many
+// allocations and copies were made. Lines that couldn't be output make it a failure
+// +++++++++++
+if (mem.lost) fprintf(stderr, "%lu lines not output: they didn't fit in --max-memory, and the input can't be read again\n", mem.lost);
+if (opts.stats) {
+    fprintf(stderr, "Peak memory: %zu bytes", mem.peak);
+    if (mem.limit) fprintf(stderr, " (--max-memory %zu)", mem.limit);
+    fprintf(stderr, "\nAllocations: %lu\n", mem.allocs);
+    fprintf(stderr, "Input: %llu bytes, %llu copied or read again (%.4f per byte)\n", mem.input, mem.copied,
+            mem.input ? (double)mem.copied / (double)mem.input : 0.0);
+}
+big_free(out.buf, out.cap);
 if (regex_compiled) regfree(&regex);
-if (opts.pattern) free(opts.pattern);
-return EXIT_SUCCESS;
+regexec_span_free();
+sre_free(opts.stream);
+pattern_free(opts.pattern);
+return mem.lost ? EXIT_FAILURE : EXIT_SUCCESS;
 
 }
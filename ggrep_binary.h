@@ -0,0 +1,49 @@
+// -----------------------------------------------------
+// ------------------ ggrep binary result format ------------------
+// -----------------------------------------------------
+// Written by "ggrep --format=binary", read by ggrep_decode (or any tool that wants
+// match positions without parsing text). All integers are little endian.
+//
+// The stream starts with an 8 byte header:
+//     char magic[4]    "GGRB"
+//     u16  version     GGRB_VERSION
+//     u16  flags       GGRB_FLAG_LINES if line records carry the line bytes (--with-lines)
+//
+// followed by records, each of which is:
+//     u64  length      bytes in the record after this field (so unknown types can be skipped)
+//     u8   type        one of GGRB_REC_*
+//     ...  payload
+//
+// Payloads:
+//   GGRB_REC_FILE   u32 file_id, u32 path_len, path bytes
+//                   names a file; sent once, before the first record that uses its file_id
+//   GGRB_REC_LINE   u32 file_id, u8 kind (GGRB_KIND_*), u64 line number, u64 byte offset of
+//                   the line in the file, u64 span_count, span_count x (u64 start, u64 end)
+//                   byte offsets within the line, then if GGRB_FLAG_LINES: u64 text_len,
+//                   text bytes (the line without its newline)
+//   GGRB_REC_COUNT  u32 file_id, u64 count of matching lines (-c)
+//   GGRB_REC_MATCHED_FILE  u32 file_id: the file has a match (-m)
+
+#ifndef GGREP_BINARY_H
+#define GGREP_BINARY_H
+
+#define GGRB_MAGIC "GGRB"
+#define GGRB_VERSION 1
+#define GGRB_HEADER_LEN 8
+
+#define GGRB_FLAG_LINES 0x0001
+
+enum {
+    GGRB_REC_FILE = 1,
+    GGRB_REC_LINE = 2,
+    GGRB_REC_COUNT = 3,
+    GGRB_REC_MATCHED_FILE = 4
+};
+
+enum {
+    GGRB_KIND_MATCH = 0,
+    GGRB_KIND_BEFORE = 1,
+    GGRB_KIND_AFTER = 2
+};
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "ggrep_binary.h"
+
+// Decode the output of "ggrep --format=binary" into tab separated text:
+//     match / before / after lines:  path <TAB> line <TAB> offset <TAB> kind <TAB> spans [<TAB> text]
+//     -c counts:                     path <TAB> count <TAB> N
+//     -m matched files:              path
+// spans are written as start-end byte offsets within the line, separated by commas.
+//
+// Usage: ggrep_decode [file]     (reads stdin if no file is given)
+
+#define GGREP_DECODE_VERSION "1.0"
+
+// ------------------Memory safe allocation helpers ----------
+void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p == NULL && size > 0) {
+        fprintf(stderr, "Fatal: Out of memory (realloc %zu bytes).\n", size);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// ------------------ Little endian readers ------------------
+unsigned get_u16(const unsigned char *p) {
+    return (unsigned)p[0] | ((unsigned)p[1] << 8);
+}
+
+unsigned long get_u32(const unsigned char *p) {
+    return (unsigned long)p[0] | ((unsigned long)p[1] << 8) |
+           ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+unsigned long long get_u64(const unsigned char *p) {
+    unsigned long long v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+// ------------------ File id -> path table ------------------
+typedef struct {
+    char **paths;
+    size_t count;
+} FileTable;
+
+const char *file_path(const FileTable *files, unsigned long id) {
+    if (id < files->count && files->paths[id]) return files->paths[id];
+    return "<unknown>";
+}
+
+void add_file(FileTable *files, unsigned long id, const unsigned char *path, size_t len) {
+    if (id >= files->count) {
+        size_t n = id + 1;
+        files->paths = xrealloc(files->paths, n * sizeof(char *));
+        for (size_t i = files->count; i < n; i++) files->paths[i] = NULL;
+        files->count = n;
+    }
+    free(files->paths[id]);
+    files->paths[id] = xrealloc(NULL, len + 1);
+    memcpy(files->paths[id], path, len);
+    files->paths[id][len] = '\0';
+}
+
+// ------------------ Record decoding ------------------
+// a record is bad if it claims more bytes than it has
+bool decode_record(const unsigned char *p, size_t len, bool with_lines, FileTable *files) {
+    int type = p[0];
+    p++;
+    len--;
+
+    switch (type) {
+        case GGRB_REC_FILE: {
+            if (len < 8) return false;
+            unsigned long id = get_u32(p);
+            unsigned long n = get_u32(p + 4);
+            if (len < 8 + n) return false;
+            add_file(files, id, p + 8, n);
+            return true;
+        }
+        case GGRB_REC_LINE: {
+            static const char *kinds[] = {"match", "before", "after"};
+            if (len < 29) return false;
+            const char *path = file_path(files, get_u32(p));
+            unsigned kind = p[4];
+            unsigned long long lineno = get_u64(p + 5);
+            unsigned long long offset = get_u64(p + 13);
+            unsigned long long nspans = get_u64(p + 21);
+            size_t pos = 29;
+            if (nspans > (len - pos) / 16) return false;
+
+            printf("%s\t%llu\t%llu\t%s\t", path, lineno, offset, kind <= GGRB_KIND_AFTER ? kinds[kind] : "?");
+            for (unsigned long long i = 0; i < nspans; i++, pos += 16)
+                printf("%s%llu-%llu", i ? "," : "", get_u64(p + pos), get_u64(p + pos + 8));
+            if (with_lines) {
+                if (len - pos < 8) return false;
+                unsigned long long n = get_u64(p + pos);
+                if (n > len - pos - 8) return false;
+                putchar('\t');
+                fwrite(p + pos + 8, 1, (size_t)n, stdout);
+            }
+            putchar('\n');
+            return true;
+        }
+        case GGRB_REC_COUNT: {
+            if (len < 12) return false;
+            printf("%s\tcount\t%llu\n", file_path(files, get_u32(p)), get_u64(p + 4));
+            return true;
+        }
+        case GGRB_REC_MATCHED_FILE: {
+            if (len < 4) return false;
+            printf("%s\n", file_path(files, get_u32(p)));
+            return true;
+        }
+        default:
+            return true;	// newer record type: the length prefix lets us skip it
+    }
+}
+
+int decode_stream(FILE *fp, const char *name) {
+    unsigned char header[GGRB_HEADER_LEN];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, GGRB_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s: not a ggrep binary stream\n", name);
+        return EXIT_FAILURE;
+    }
+    if (get_u16(header + 4) != GGRB_VERSION) {
+        fprintf(stderr, "%s: unsupported format version %u\n", name, get_u16(header + 4));
+        return EXIT_FAILURE;
+    }
+    bool with_lines = (get_u16(header + 6) & GGRB_FLAG_LINES) != 0;
+
+    FileTable files = {NULL, 0};
+    unsigned char *rec = NULL;
+    size_t rec_cap = 0;
+    int status = EXIT_SUCCESS;
+    unsigned char lenbuf[8];
+
+    while (fread(lenbuf, 1, 8, fp) == 8) {
+        unsigned long long n = get_u64(lenbuf);
+        if (n > SIZE_MAX) {
+            fprintf(stderr, "%s: record too big to decode here\n", name);
+            status = EXIT_FAILURE;
+            break;
+        }
+        size_t len = (size_t)n;
+        if (len > rec_cap) {
+            rec_cap = len;
+            rec = xrealloc(rec, rec_cap);
+        }
+        if (len == 0 || fread(rec, 1, len, fp) != len || !decode_record(rec, len, with_lines, &files)) {
+            fprintf(stderr, "%s: truncated or corrupt record\n", name);
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < files.count; i++) free(files.paths[i]);
+    free(files.paths);
+    free(rec);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2 || (argc == 2 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "-v") == 0))) {
+        fprintf(stderr, "ggrep_decode v%s\nUsage: ggrep_decode [file]  (decodes ggrep --format=binary output)\n",
+                GGREP_DECODE_VERSION);
+        return argc > 2 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (argc == 1) return decode_stream(stdin, "<stdin>");
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (!fp) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    int status = decode_stream(fp, argv[1]);
+    fclose(fp);
+    return status;
+}
@@ -0,0 +1,17 @@
+#!/bin/sh
+# make bench-postings: index a copy of DIR (so the index never lands in DIR, and every run
+# indexes the same files) and time decoding its posting lists against reading them as plain
+# uint32 arrays, with ggrep --index bench. SHARDS sets --shards (default 1).
+# Usage: bench_postings.sh GGREP DIR
+GGREP=$1
+SRC=$2
+SHARDS=${SHARDS:-1}
+
+if [ ! -d "$SRC" ]; then echo "bench-postings: $SRC is not a directory"; exit 1; fi
+case "$GGREP" in /*) ;; *) GGREP=$(pwd)/$GGREP ;; esac
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cp -R "$SRC/." "$DIR/" 2> /dev/null
+"$GGREP" --index build --shards="$SHARDS" "$DIR" || exit 1
+"$GGREP" --index bench "$DIR"
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Write a test corpus of about MB megabytes to stdout: lines of 3 to 14 words (some
+# tab-separated), the same on every run. One line in 97 has "needle" in it, and one in
+# 389 "NEEDLE", so -i finds more.
+# Usage: gen_corpus.sh MB
+MB=${1:-4}
+awk -v bytes=$((MB * 1024 * 1024)) 'BEGIN {
+    split("alpha beta gamma delta epsilon zeta theta kappa lambda sigma omega struct \
+           int return static const buffer offset length value", w, " ")
+    seed = 12345; size = 0; n = 0
+    while (size < bytes) {
+        n++
+        line = ""
+        seed = (seed * 1103515245 + 12345) % 2147483648
+        words = 3 + seed % 12
+        for (i = 0; i < words; i++) {
+            seed = (seed * 1103515245 + 12345) % 2147483648
+            line = line (i ? (seed % 7 == 0 ? "\t" : " ") : "") w[1 + int(seed / 65536) % 19]
+        }
+        if (n % 97 == 0) line = line " needle"
+        if (n % 389 == 0) line = "NEEDLE " line
+        print line
+        size += length(line) + 1
+    }
+}'
@@ -0,0 +1,57 @@
+#!/bin/sh
+# make test-alloc: run ggrep under tests/alloc_shim.so over a small and a 4x larger generated
+# corpus and fail if
+#   - the number of allocations grows with the input (more than ALLOC_SLACK extra), or
+#   - the bytes memcpy'd / memmove'd per input byte go over MAX_COPY_PER_BYTE. Output is
+#     copied into the output buffer once, so the bytes written out are not counted
+# Lines are searched as views of the read buffer, so neither should depend on input size.
+# Usage: test_alloc.sh GGREP SHIM
+GGREP=$1
+SHIM=$2
+ALLOC_SLACK=${ALLOC_SLACK:-4}
+MAX_COPY_PER_BYTE=${MAX_COPY_PER_BYTE:-0.1}
+SMALL_MB=${SMALL_MB:-4}
+LARGE_MB=${LARGE_MB:-16}
+
+case "$GGREP" in /*) ;; *) GGREP=$(pwd)/$GGREP ;; esac
+case "$SHIM" in /*) ;; *) SHIM=$(pwd)/$SHIM ;; esac
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+HERE=$(dirname "$0")
+sh "$HERE/gen_corpus.sh" "$SMALL_MB" > "$DIR/small"
+sh "$HERE/gen_corpus.sh" "$LARGE_MB" > "$DIR/large"
+
+# run OPTIONS CORPUS: sets allocs and copied (less the output). Options starting with "|"
+# have the corpus piped in
+run() {
+    case "$1" in
+        "|"*) cat "$DIR/$2" | GGREP_ALLOC_LOG="$DIR/log" LD_PRELOAD="$SHIM" "$GGREP" ${1#|} > "$DIR/out" || return 1 ;;
+        *) GGREP_ALLOC_LOG="$DIR/log" LD_PRELOAD="$SHIM" "$GGREP" $1 "$DIR/$2" > "$DIR/out" || return 1 ;;
+    esac
+    allocs=$(awk '$1 == "allocs" { print $2 }' "$DIR/log")
+    copied=$(awk -v out="$(wc -c < "$DIR/out")" '$1 == "copied" { print ($2 > out ? $2 - out : 0) }' "$DIR/log")
+}
+
+fail=0
+for opts in "needle" "-i needle" "-E ne*dle" "-E -i ne*dle" "-E --color=always ne*dle" \
+            "-b2 -a2 needle" "-b50 -a1 -n needle" "-c needle" "-c -i needle" "-n -f needle" \
+            "|needle" "|-E -b2 -a2 ne*dle"; do
+    if ! run "$opts" small; then echo "FAIL: ggrep $opts exited with an error"; fail=1; continue; fi
+    small_allocs=$allocs
+    if ! run "$opts" large; then echo "FAIL: ggrep $opts exited with an error"; fail=1; continue; fi
+    size=$(wc -c < "$DIR/large")
+    per_byte=$(awk -v c="$copied" -v s="$size" 'BEGIN { printf "%.4f", c / s }')
+    status=ok
+    if [ "$allocs" -gt $((small_allocs + ALLOC_SLACK)) ]; then
+        status=FAIL
+        echo "FAIL: ggrep $opts: $small_allocs allocations for ${SMALL_MB} MB, $allocs for ${LARGE_MB} MB"
+    fi
+    if awk -v p="$per_byte" -v m="$MAX_COPY_PER_BYTE" 'BEGIN { exit !(p > m) }'; then
+        status=FAIL
+        echo "FAIL: ggrep $opts: copied $per_byte bytes per input byte (limit $MAX_COPY_PER_BYTE)"
+    fi
+    [ $status = FAIL ] && fail=1
+    printf '%-28s allocs %4s -> %-4s copied/byte %s  %s\n' "$opts" "$small_allocs" "$allocs" "$per_byte" "$status"
+done
+[ $fail = 0 ] && echo "test-alloc: passed" || echo "test-alloc: FAILED"
+exit $fail
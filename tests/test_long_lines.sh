@@ -0,0 +1,116 @@
+#!/bin/sh
+# make test-long-lines: search generated files that are one 10 MB line (a few with a short
+# line after) and check ggrep's output against grep's. Matches sit at the start and end of
+# the line and across the edges of ggrep's read blocks, where a line searched in pieces
+# could miss them. Each search is done as it is, with --max-memory (the line is searched in
+# pieces and read back from the file to print it) and from a pipe. A pipe can't be read
+# again, so with --max-memory a line that is printed can't be output: ggrep must say so and
+# exit non-zero, while -c still counts it.
+# Usage: test_long_lines.sh GGREP
+GGREP=$1
+LINE_MB=${LINE_MB:-10}
+MAX_MEMORY=${MAX_MEMORY:-1M}
+
+case "$GGREP" in /*) ;; *) GGREP=$(pwd)/$GGREP ;; esac
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# gen NAME NEWLINE AFTER POS:WORD...: a LINE_MB line of filler with WORD written at each
+# byte offset POS (negative: from the end), ending in a newline if NEWLINE is 1 and followed
+# by the line AFTER if it isn't empty. The filler has no "needle" or "ne*dle" in it
+gen() {
+    name=$1 newline=$2 after=$3
+    shift 3
+    awk -v mb="$LINE_MB" -v newline="$newline" -v after="$after" -v words="$*" 'BEGIN {
+        n = mb * 1024 * 1024
+        fill = "abcdefghijklmopqrstuvwxyz0123456789 "
+        while (length(fill) < 65536) fill = fill fill
+        k = split(words, w, " ")
+        for (i = 1; i <= k; i++) {
+            split(w[i], pw, ":")
+            pos[i] = pw[1] < 0 ? n + pw[1] : pw[1] + 0
+            word[i] = pw[2]
+        }
+        # write the line in blocks, putting in the part of each word that falls in them
+        for (at = 0; at < n; at += len) {
+            len = n - at < 65536 ? n - at : 65536
+            block = substr(fill, 1, len)
+            for (i = 1; i <= k; i++) {
+                from = pos[i] > at ? pos[i] : at
+                to = pos[i] + length(word[i]) < at + len ? pos[i] + length(word[i]) : at + len
+                if (from < to)
+                    block = substr(block, 1, from - at) substr(word[i], from - pos[i] + 1, to - from) substr(block, to - at + 1)
+            }
+            printf "%s", block
+        }
+        if (newline) printf "\n"
+        if (after != "") printf "%s\n", after
+    }' > "$DIR/$name"
+}
+
+B=262144	# ggrep's read block
+gen middle 1 "" 5000000:needle
+gen edges 0 "" 0:needle -6:needle
+gen blocks 1 "" $((B - 3)):needle $((2 * B - 1)):NEEDLE $((4 * B - 5)):NeEdLe $((8 * B)):neeeedle
+gen after 1 "a short needle line" 123:zz
+gen none 1 "" 1000:needl 2000:eedle 3000:NEEDL
+
+fail=0
+# check OPTIONS: ggrep OPTIONS against grep OPTIONS for every file; -c output is FILE:COUNT
+check() {
+    for f in middle edges blocks after none; do
+        (cd "$DIR" && grep $1 "$f") > "$DIR/expected"
+        case "$1" in *-c*) echo "$f:$(cat "$DIR/expected")" > "$DIR/expected" ;; esac
+
+        for how in file max-memory pipe pipe-max-memory; do
+            case $how in
+                file) (cd "$DIR" && "$GGREP" $1 "$f") > "$DIR/out" 2> "$DIR/err" ;;
+                max-memory) (cd "$DIR" && "$GGREP" --max-memory=$MAX_MEMORY $1 "$f") > "$DIR/out" 2> "$DIR/err" ;;
+                pipe) cat "$DIR/$f" | "$GGREP" $1 > "$DIR/out" 2> "$DIR/err" ;;
+                pipe-max-memory) cat "$DIR/$f" | "$GGREP" --max-memory=$MAX_MEMORY $1 > "$DIR/out" 2> "$DIR/err" ;;
+            esac
+            status=$?
+            expected="$DIR/expected"
+            case "$how:$1" in
+                pipe*-c*) sed "s/^$f:/<stdin>:/" "$DIR/expected" > "$DIR/expected_stdin"; expected="$DIR/expected_stdin" ;;
+            esac
+
+            # from a pipe with --max-memory a matching 10 MB line can't be printed: only the
+            # short line after it can be, and ggrep has to fail
+            if [ $how = pipe-max-memory ] && grep -q '^.\{1000\}' "$expected"; then
+                grep -v '^.\{1000\}' "$expected" > "$DIR/expected_short"
+                if [ $status -eq 0 ] || ! grep -q 'not output' "$DIR/err"; then
+                    echo "FAIL: $how ggrep $1 $f: exited $status without saying the line wasn't output"
+                    fail=1
+                elif ! cmp -s "$DIR/expected_short" "$DIR/out"; then
+                    echo "FAIL: $how ggrep $1 $f: the lines that could be output differ from grep's"
+                    fail=1
+                else
+                    echo "ok    $how ggrep $1 $f (failed as it should)"
+                fi
+                continue
+            fi
+
+            if [ $status -ne 0 ]; then
+                echo "FAIL: $how ggrep $1 $f exited $status: $(head -c 200 "$DIR/err")"
+                fail=1
+            elif ! cmp -s "$expected" "$DIR/out"; then
+                echo "FAIL: $how ggrep $1 $f: output differs from grep's ($(wc -c < "$DIR/out") bytes, expected $(wc -c < "$expected"))"
+                fail=1
+            else
+                echo "ok    $how ggrep $1 $f"
+            fi
+        done
+    done
+}
+
+check "needle"
+check "-i needle"
+check "-E ne*dle"
+check "-E -i ne*dle"
+check "-c needle"
+check "-c -i needle"
+check "-c -E ne*dle"
+
+if [ $fail -ne 0 ]; then echo "test-long-lines: FAILED"; exit 1; fi
+echo "test-long-lines: passed"